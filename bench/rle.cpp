@@ -0,0 +1,91 @@
+// compares the SSE2 protection codec to rle.hpp on chunk sized layers, run with
+// make bench && build/bench_rle
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <cstring>
+
+#include <ProtectionRle.hpp>
+#include <rle.hpp>
+
+using Layers = std::vector<std::vector<u32>>;
+
+template<typename F>
+static double nsPerLayer(const Layers& layers, int rounds, F f) {
+	auto start(std::chrono::steady_clock::now());
+	for (int r = 0; r < rounds; r++) {
+		for (const auto& l : layers) {
+			f(l);
+		}
+	}
+
+	std::chrono::duration<double, std::nano> t(std::chrono::steady_clock::now() - start);
+	return t.count() / (rounds * layers.size());
+}
+
+int main() {
+	const sz_t cells = 32 * 32;
+	const int rounds = 50;
+	std::mt19937 rng(1);
+
+	// what chunks usually look like: unprotected, fully protected, protected
+	// rectangles and scattered cells
+	Layers layers(4096, std::vector<u32>(cells));
+	for (sz_t i = 0; i < layers.size(); i++) {
+		auto& l = layers[i];
+		switch (i % 4) {
+		case 1:
+			std::fill(l.begin(), l.end(), rng() % 100 + 1);
+			break;
+
+		case 2: {
+			u32 x = rng() % 32, y = rng() % 32, w = rng() % (32 - x) + 1, h = rng() % (32 - y) + 1;
+			for (u32 cy = y; cy < y + h; cy++) {
+				std::fill(&l[cy * 32 + x], &l[cy * 32 + x + w], rng() % 100 + 1);
+			}
+		} break;
+
+		case 3:
+			for (auto& c : l) {
+				c = rng() % 8 == 0 ? rng() % 100 + 1 : 0;
+			}
+			break;
+		}
+	}
+
+	std::cout << "fast codec matches rle.hpp: " << prle::isFastCompatible() << std::endl;
+
+	std::vector<std::vector<u8>> encoded;
+	for (const auto& l : layers) {
+		encoded.emplace_back(prle::compressFast(l.data(), l.size()));
+	}
+
+	volatile sz_t sink = 0;
+	double rleC = nsPerLayer(layers, rounds, [&] (const std::vector<u32>& l) {
+		sink = sink + rle::compress(l.data(), l.size()).second;
+	});
+
+	double fastC = nsPerLayer(layers, rounds, [&] (const std::vector<u32>& l) {
+		sink = sink + prle::compressFast(l.data(), l.size()).size();
+	});
+
+	std::vector<u32> out(cells);
+	sz_t i = 0;
+	double rleD = nsPerLayer(layers, rounds, [&] (const std::vector<u32>&) {
+		const auto& e = encoded[i++ % encoded.size()];
+		rle::decompress(e.data(), e.size(), out.data(), out.size());
+		sink = sink + out[0];
+	});
+
+	i = 0;
+	double fastD = nsPerLayer(layers, rounds, [&] (const std::vector<u32>&) {
+		const auto& e = encoded[i++ % encoded.size()];
+		prle::decompressFast(e.data(), e.size(), out.data(), out.size());
+		sink = sink + out[0];
+	});
+
+	std::cout << "compress   rle.hpp: " << rleC << " ns/layer, sse2: " << fastC << " ns/layer" << std::endl;
+	std::cout << "decompress rle.hpp: " << rleD << " ns/layer, sse2: " << fastD << " ns/layer" << std::endl;
+	return 0;
+}
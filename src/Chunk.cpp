@@ -1,12 +1,18 @@
 #include "Chunk.hpp"
 
 #include <vector>
+#include <algorithm>
 #include <iostream>
-#include <fstream>
-#include <cstdio> // std::remove
+#include <cstring>
 
-#include <rle.hpp>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <ProtectionRle.hpp>
 #include <utils.hpp>
+#include <PngImage.hpp>
+#include <PngDecoder.hpp>
 #include <Storage.hpp>
 
 static_assert((Chunk::size & (Chunk::size - 1)) == 0,
@@ -21,15 +27,142 @@ static_assert((Chunk::size % Chunk::protectionAreaSize) == 0,
 static_assert((Chunk::pc & (Chunk::pc - 1)) == 0,
 	"size / protectionAreaSize must result in a power of 2");
 
+// colors are packed as 0x00BBGGRR to compare and store them in palettes
+static u32 packRgb(RGB_u clr) {
+	return clr.r | clr.g << 8 | clr.b << 16;
+}
+
+static u32 packRgb(const u8 * p) {
+	return p[0] | p[1] << 8 | p[2] << 16;
+}
+
+// counts the RGB pixels that are different from clr
+static u32 countDifferentPixels(const u8 * p, sz_t pixels, RGB_u clr) {
+	u32 count = 0;
+	sz_t i = 0;
+
+#ifdef __SSE2__
+	// 16 pixels (48 bytes) per iteration, the color pattern repeats every 3 vectors
+	alignas(16) u8 pattern[48 + 3];
+	for (u32 j = 0; j < sizeof(pattern); j += 3) {
+		pattern[j] = clr.r;
+		pattern[j + 1] = clr.g;
+		pattern[j + 2] = clr.b;
+	}
+
+	const __m128i c0 = _mm_load_si128(reinterpret_cast<const __m128i *>(pattern));
+	const __m128i c1 = _mm_load_si128(reinterpret_cast<const __m128i *>(pattern + 16));
+	const __m128i c2 = _mm_load_si128(reinterpret_cast<const __m128i *>(pattern + 32));
+
+	for (; i + 16 <= pixels; i += 16, p += 48) {
+		u64 eq = static_cast<u64>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)), c0)))
+			| static_cast<u64>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16)), c1))) << 16
+			| static_cast<u64>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 32)), c2))) << 32;
+
+		if (eq == 0xFFFFFFFFFFFF) {
+			continue;
+		}
+
+		// a pixel differs if any of its 3 byte bits is unset, gather them on the first bit
+		u64 ne = ~eq & 0xFFFFFFFFFFFF;
+		ne |= (ne >> 1) | (ne >> 2);
+		count += __builtin_popcountll(ne & 0x249249249249);
+	}
+#endif
+
+	for (; i < pixels; i++, p += 3) {
+		count += packRgb(p) != packRgb(clr);
+	}
+
+	return count;
+}
+
+// counts the bytes that are different from v
+static u32 countDifferentBytes(const u8 * p, sz_t size, u8 v) {
+	u32 count = 0;
+	sz_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i c = _mm_set1_epi8(v);
+	for (; i + 16 <= size; i += 16, p += 16) {
+		u32 eq = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)), c));
+		count += 16 - __builtin_popcount(eq);
+	}
+#endif
+
+	for (; i < size; i++, p++) {
+		count += *p != v;
+	}
+
+	return count;
+}
+
+// counts the u32s that are different from v
+static u32 countDifferentCells(const u32 * p, sz_t size, u32 v) {
+	u32 count = 0;
+	sz_t i = 0;
+
+#ifdef __SSE2__
+	// 16 cells per iteration, runs of equal cells (the usual case) only cost a compare
+	const __m128i c = _mm_set1_epi32(v);
+	for (; i + 16 <= size; i += 16, p += 16) {
+		const __m128i * q = reinterpret_cast<const __m128i *>(p);
+		__m128i e0 = _mm_cmpeq_epi32(_mm_loadu_si128(q), c);
+		__m128i e1 = _mm_cmpeq_epi32(_mm_loadu_si128(q + 1), c);
+		__m128i e2 = _mm_cmpeq_epi32(_mm_loadu_si128(q + 2), c);
+		__m128i e3 = _mm_cmpeq_epi32(_mm_loadu_si128(q + 3), c);
+		u32 eq = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3)));
+		if (eq == 0xFFFF) {
+			continue;
+		}
+
+		// each cell is 4 bits of the masks
+		count += 16 - (__builtin_popcount(_mm_movemask_epi8(e0)) + __builtin_popcount(_mm_movemask_epi8(e1))
+			+ __builtin_popcount(_mm_movemask_epi8(e2)) + __builtin_popcount(_mm_movemask_epi8(e3))) / 4;
+	}
+#endif
+
+	for (; i < size; i++, p++) {
+		count += *p != v;
+	}
+
+	return count;
+}
+
 Chunk::Chunk(Pos x, Pos y, const WorldStorage& ws)
 : lastAction(std::chrono::steady_clock::now()),
+  lruPrev(nullptr),
+  lruNext(nullptr),
+  saveQueued(false),
+  saving(false),
+  unloadAfterSave(false),
   x(x),
   y(y),
   ws(ws),
-  canUnload(false), // DON'T unload before this is constructed (can happen by alloc fail)
+  bgClr(ws.getBackgroundColor()),
+  palette(std::make_shared<std::vector<u32>>()),
+  pngEncoder(Chunk::size, Chunk::size),
+  nonBgPixels(0),
+  nonZeroProtCells(0),
+  version(0),
+  paletteHint(0),
+  unloadLocks(1), // DON'T unload before this is loaded
+  loaded(false),
   protectionDataEmpty(false),
+  protectionRleOutdated(true),
   pngCacheOutdated(true),
-  pngFileOutdated(false) {
+  pngFileOutdated(false) { }
+
+// only touches this chunk, so it can run in a worker thread
+void Chunk::load() {
+	// chunks without a stored version start from the current time, so that
+	// a chunk deleted and drawn on again doesn't repeat old versions
+	version = ws.getChunkVersion(x, y);
+	if (version == 0) {
+		version = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
 	bool readerCalled = false;
   	auto fail = [this] {
   		std::cerr << "Protection data corrupted for chunk "
@@ -39,103 +172,254 @@ Chunk::Chunk(Pos x, Pos y, const WorldStorage& ws)
 		protectionDataEmpty = true;
   	};
 
-	data.setChunkReader("woPp", [this, fail{std::move(fail)}, &readerCalled] (u8 * d, sz_t size) {
+	auto woPpReader = [this, fail{std::move(fail)}, &readerCalled] (u8 * d, sz_t size) {
 		// returning false will throw
 		// instead of stopping the server, reset the protections
 		// for this chunk
 		readerCalled = true;
-		try {
-			if (rle::getItems<u32>(d, size) != protectionData.size()) {
-				fail();
-				return true;
-			}
-
-			rle::decompress(d, size, protectionData.data(), protectionData.size());
-		} catch(std::length_error& e) {
+		if (!prle::decompress(d, size, protectionData.data(), protectionData.size())) {
 			fail();
 			return true;
 		}
 
+		// written back as is, until the cells change
+		protectionRle.assign(d, d + size);
+		protectionRleOutdated = false;
 		return true;
-	});
+	};
+
+	// decoded straight from the page cache. the png isn't kept in memory,
+	// until it's modified requests are served from the file
+	RegionFile::View file(ws.mapChunk(x, y, true));
+	if (file) {
+		// pixels are stored indexed until the chunk has more than 256 colors
+		materialize();
+
+		PngDecoder dec;
+		dec.setChunkReader("woPp", woPpReader);
+		std::unique_ptr<u8[]> rgbRow;
+		bool decoded = dec.decode(file.data(), file.size(), [this, &dec, &rgbRow] (u32 py, const u8 * row) {
+			const u32 w = std::min<u32>(dec.getWidth(), Chunk::size);
+			if (py >= Chunk::size) {
+				return;
+			}
 
-	data.setChunkWriter("woPp", [this] {
-		std::shared_lock<std::shared_timed_mutex> _(sm);
-		if (protectionDataEmpty) {
-			// don't write protection data if it's all 0
-			return std::pair<std::unique_ptr<u8[]>, sz_t>{nullptr, 0};
-		}
+			if (dec.getColorType() == PngDecoder::PALETTE && dec.getPalette().size() >= 3
+					&& dec.getPalette().size() <= 256 * 3 && w == Chunk::size
+					&& dec.getHeight() == Chunk::size && isIndexed()) {
+				// our own format, indices can be copied directly
+				if (py == 0) {
+					const auto& plte = dec.getPalette();
+					palette->clear();
+					for (sz_t i = 0; i + 2 < plte.size(); i += 3) {
+						palette->push_back(packRgb(&plte[i]));
+					}
+				}
+
+				u8 * dst = data.get() + py * Chunk::size;
+				std::memcpy(dst, row, Chunk::size);
+				u8 maxIdx = *std::max_element(dst, dst + Chunk::size);
+				if (maxIdx >= palette->size()) {
+					palette->resize(maxIdx + 1, 0);
+				}
+
+				return;
+			}
 
-		return rle::compress(protectionData.data(), protectionData.size());
-	});
+			if (!rgbRow) {
+				rgbRow = std::make_unique<u8[]>(dec.getWidth() * 3);
+			}
 
-	std::ifstream ch(ws.getChunkFilePath(x, y), std::ios::binary | std::ios::ate);
-	if (ch) {
-		sz_t size = ch.tellg();
-		ch.seekg(0);
-		pngCache.resize(size);
-		ch.read(reinterpret_cast<char *>(pngCache.data()), size);
-		pngCacheOutdated = false;
+			dec.rowToRgb(row, rgbRow.get());
+			for (u32 px = 0; px < w; px++) {
+				putPackedPixel(px, py, packRgb(&rgbRow[px * 3]));
+			}
+		});
+
+		if (!decoded) {
+			// uncommon format, let PngImage deal with it
+			PngImage img;
+			img.setChunkReader("woPp", woPpReader);
+			img.readFileOnMem(file.data(), file.size());
+			const u32 w = std::min<u32>(img.getWidth(), Chunk::size);
+			const u32 h = std::min<u32>(img.getHeight(), Chunk::size);
+			for (u32 py = 0; py < h; py++) {
+				for (u32 px = 0; px < w; px++) {
+					putPackedPixel(px, py, packRgb(img.getPixel(px, py)));
+				}
+			}
+		}
 
-		data.readFileOnMem(pngCache.data(), pngCache.size());
 		if (!readerCalled) {
 			protectionData.fill(0);
 			protectionDataEmpty = true;
 		}
+
+		countNonEmpty();
+		if (nonZeroProtCells == 0) {
+			// the woPp chunk isn't written again if it's all 0
+			protectionDataEmpty = true;
+		}
+
+		if (nonBgPixels == 0) {
+			// nothing drawn here, no need to keep the pixels around
+			data = nullptr;
+			palette->clear();
+		}
 	} else {
-		data.allocate(Chunk::size, Chunk::size, ws.getBackgroundColor());
+		// solid chunk, the pixel buffer is allocated when something is drawn
 		protectionData.fill(0);
 		protectionDataEmpty = true;
 	}
+}
 
-	preventUnloading(false);
+void Chunk::setLoaded() {
+	if (!data && !pngCache && protectionDataEmpty) {
+		// the solid png is shared, so it's only read from the main thread.
+		// it has no woPp chunk, so protected chunks get their own
+		pngCache = std::make_shared<const std::vector<u8>>(ws.getSolidChunkPng());
+		pngCacheOutdated = false;
+	}
+
+	loaded = true;
 }
 
-Chunk::~Chunk() {
-	if (isChunkEmpty()) {
-		std::string fpath(ws.getChunkFilePath(x, y));
-		if (std::remove(fpath.c_str())) {
-			std::string s("Couldn't delete chunk file (" + fpath + ")");
-			std::perror(s.c_str());
-		}
+bool Chunk::isLoaded() const {
+	return loaded;
+}
 
+Chunk::~Chunk() {
+	if (!loaded) {
+		// failed to load, or never did. the file must be left alone
 		return;
 	}
 
 	try {
+		if (isChunkEmpty()) {
+			ws.deleteChunk(x, y);
+			return;
+		}
+
 		save();
 	} catch (const std::runtime_error& e) {
 		std::cerr << "Error while saving chunk: " << e.what() << std::endl;
 	}
 }
 
+Chunk::Pos Chunk::getX() const {
+	return x;
+}
+
+Chunk::Pos Chunk::getY() const {
+	return y;
+}
+
+RGB_u Chunk::getPixel(u16 x, u16 y) const {
+	x &= Chunk::size - 1;
+	y &= Chunk::size - 1;
+
+	u32 c = data ? getPackedPixel(x, y) : packRgb(bgClr);
+	RGB_u clr;
+	clr.r = c;
+	clr.g = c >> 8;
+	clr.b = c >> 16;
+	clr.a = 255;
+	return clr;
+}
+
 bool Chunk::setPixel(u16 x, u16 y, RGB_u clr) {
 	x &= Chunk::size - 1;
 	y &= Chunk::size - 1;
 
-	if (data.getPixel(x, y).rgb != clr.rgb) {
+	const u32 bg = packRgb(bgClr);
+	const u32 c = packRgb(clr);
+	if (!data) {
+		if (c == bg) {
+			return false;
+		}
+
+		materialize();
+	}
+
+	const u32 old = getPackedPixel(x, y);
+	if (old != c) {
+		nonBgPixels += (old == bg) - (c == bg);
+
 		updateLastActionTime();
 #warning "Fix possible concurrent access"
-		data.setPixel(x, y, clr); // XXX: possible concurrent access... must be looked at
+		putPackedPixel(x, y, c); // XXX: possible concurrent access... must be looked at
+		pngEncoder.markRowDirty(y);
 		pngFileOutdated = true;
 		pngCacheOutdated = true;
+		++version;
 		return true;
 	}
 
 	return false;
 }
 
+bool Chunk::isSolid() const {
+	return !data;
+}
+
+bool Chunk::isIndexed() const {
+	return !palette->empty();
+}
+
 void Chunk::setProtectionGid(ProtPos x, ProtPos y, u32 gid) {
+	setProtectionArea(x, y, 1, 1, gid);
+}
+
+// x and y are the first cell, the area must be inside of the chunk
+bool Chunk::setProtectionArea(ProtPos x, ProtPos y, u32 w, u32 h, u32 gid) {
 	//updateLastActionTime();
 	x &= Chunk::pc - 1;
 	y &= Chunk::pc - 1;
 
-	pngFileOutdated = true;
-	pngCacheOutdated = true;
+	bool changed = false;
+
+	{
+		std::unique_lock<std::shared_timed_mutex> _(sm);
+		for (u32 py = y; py < y + h; py++) {
+			u32 * row = &protectionData[py * Chunk::pc];
+			for (u32 px = x; px < x + w; px++) {
+				u32& cell = row[px];
+				if (cell != gid) {
+					nonZeroProtCells += (cell == 0) - (gid == 0);
+					cell = gid;
+					changed = true;
+				}
+			}
+		}
 
+		if (changed) {
+			protectionDataEmpty = false;
+			protectionRleOutdated = true;
+		}
+	}
+
+	if (changed) {
+		pngFileOutdated = true;
+		pngCacheOutdated = true;
+		++version;
+	}
+
+	return changed;
+}
+
+std::vector<u8> Chunk::getProtectionRle() {
 	std::unique_lock<std::shared_timed_mutex> _(sm);
-	protectionDataEmpty = false;
-	protectionData[y * Chunk::pc + x] = gid;
+	if (protectionDataEmpty) {
+		return {};
+	}
+
+	// only compressed again if the cells changed
+	if (protectionRleOutdated) {
+		protectionRle = prle::compress(protectionData.data(), protectionData.size());
+		protectionRleOutdated = false;
+	}
+
+	return protectionRle;
 }
 
 u32 Chunk::getProtectionGid(ProtPos x, ProtPos y) const {
@@ -146,6 +430,10 @@ u32 Chunk::getProtectionGid(ProtPos x, ProtPos y) const {
 	return protectionData[y * Chunk::pc + x];
 }
 
+u64 Chunk::getVersion() const {
+	return version;
+}
+
 bool Chunk::isPngCacheOutdated() const {
 	return pngCacheOutdated;
 }
@@ -154,29 +442,144 @@ void Chunk::unsetCacheOutdatedFlag() {
 	pngCacheOutdated = false;
 }
 
-void Chunk::updatePngCache() {
-	data.writeFileOnMem(pngCache);
-	// pngCacheOutdated = false;
+Chunk::Png Chunk::encodePng() {
+	// don't write protection data if it's all 0
+	std::vector<u8> prot(getProtectionRle());
+	auto png(std::make_shared<std::vector<u8>>());
+
+	std::lock_guard<std::mutex> _(pngMtx);
+	std::shared_ptr<u8[]> px;
+	std::shared_ptr<std::vector<u32>> plt;
+	bool indexed;
+	{
+		std::lock_guard<std::mutex> b(bufMtx);
+		px = data;
+		plt = palette;
+		indexed = !plt->empty();
+	}
+
+	std::unique_ptr<u8[]> solidRow;
+	if (!px) {
+		// solid chunks with protections set still need to be encoded
+		solidRow = std::make_unique<u8[]>(Chunk::size);
+	}
+
+	auto fmt = px && !indexed ? IncrementalPngEncoder::RGB : IncrementalPngEncoder::PALETTE;
+	const sz_t stride = Chunk::size * (indexed ? 1 : 3);
+
+	// only the bands with modified rows get compressed again
+	pngEncoder.encode(*png, fmt, [&px, &solidRow, stride] (u32 y) {
+		return solidRow ? solidRow.get() : px.get() + y * stride;
+	}, [this, &plt, &solidRow] {
+		std::vector<u8> plte;
+		if (solidRow) {
+			plte = {bgClr.r, bgClr.g, bgClr.b};
+		} else {
+			// colors can still be added, the rows only use the ones there by now
+			std::lock_guard<std::mutex> b(bufMtx);
+			for (u32 c : *plt) {
+				plte.insert(plte.end(), {u8(c), u8(c >> 8), u8(c >> 16)});
+			}
+		}
+
+		return plte;
+	}, "woPp", prot.empty() ? nullptr : prot.data(), prot.size());
+
+	std::lock_guard<std::mutex> b(bufMtx);
+	if (data != px) {
+		// replaced while encoding, bands marked dirty before they were read are clean now
+		pngEncoder.markAllDirty();
+	}
+
+	return png;
+}
+
+void Chunk::setPngData(Png png) {
+	pngCache = std::move(png);
 }
 
-const std::vector<u8>& Chunk::getPngData() const {
+const Chunk::Png& Chunk::getPngData() const {
 	return pngCache;
 }
 
+void Chunk::downscale(u8 * out, sz_t stride) {
+	std::shared_ptr<u8[]> px;
+	std::shared_ptr<std::vector<u32>> plt;
+	std::vector<u32> colors;
+	{
+		std::lock_guard<std::mutex> _(bufMtx);
+		px = data;
+		plt = palette;
+		colors = *plt;
+	}
+
+	const bool indexed = !colors.empty();
+	auto pixel = [&] (u32 x, u32 y) {
+		sz_t i = static_cast<sz_t>(y) * Chunk::size + x;
+		if (!px) {
+			return packRgb(bgClr);
+		} else if (!indexed) {
+			return packRgb(&px[i * 3]);
+		}
+
+		u8 idx = px[i];
+		if (idx >= colors.size()) {
+			// drawn with a color added after the copy
+			std::lock_guard<std::mutex> _(bufMtx);
+			colors = *plt;
+		}
+
+		return idx < colors.size() ? colors[idx] : packRgb(bgClr);
+	};
+
+	auto rows(std::make_unique<u8[]>(Chunk::size * 3 * 2));
+	u8 * a = rows.get();
+	u8 * b = a + Chunk::size * 3;
+	for (u32 y = 0; y < Chunk::size; y += 2) {
+		for (u32 x = 0; x < Chunk::size; x++) {
+			u32 c = pixel(x, y);
+			u32 d = pixel(x, y + 1);
+			a[x * 3] = c; a[x * 3 + 1] = c >> 8; a[x * 3 + 2] = c >> 16;
+			b[x * 3] = d; b[x * 3 + 1] = d >> 8; b[x * 3 + 2] = d >> 16;
+		}
+
+		halveRows(a, b, out + y / 2 * stride);
+	}
+}
+
+void Chunk::halveRows(const u8 * a, const u8 * b, u8 * out) {
+	for (u32 i = 0; i < Chunk::size / 2 * 3; i++) {
+		// the channel of this pixel, one pixel further is 3 bytes away
+		u32 j = i / 3 * 6 + i % 3;
+		out[i] = (a[j] + a[j + 3] + b[j] + b[j + 3] + 2) / 4;
+	}
+}
+
+bool Chunk::isPngFileOutdated() const {
+	return pngFileOutdated;
+}
+
+void Chunk::setFileOutdatedFlag() {
+	pngFileOutdated = true;
+}
+
+void Chunk::unsetFileOutdatedFlag() {
+	pngFileOutdated = false;
+}
+
+// doesn't touch the flags or the cache, so it can be called from a worker thread
+void Chunk::writePngFile(const std::vector<u8>& png, u64 fileVersion) {
+	ws.writeChunk(x, y, png.data(), png.size(), fileVersion);
+}
+
 bool Chunk::save() {
 	if (pngFileOutdated) {
-		std::string fpath(ws.getChunkFilePath(x, y));
-		if (pngCacheOutdated) {
-			data.writeFile(fpath);
-		} else {
-			std::ofstream f(fpath, std::ios::out | std::ios::binary | std::ios::trunc);
-			if (!f) {
-				throw std::runtime_error("Couldn't open file: " + fpath);
-			}
-
-			f.write(reinterpret_cast<char *>(pngCache.data()), pngCache.size());
+		if (pngCacheOutdated || !pngCache) {
+			pngCache = encodePng();
+			pngCacheOutdated = false;
 		}
 
+		writePngFile(*pngCache, version);
 		pngFileOutdated = false;
 		return true;
 	}
@@ -193,35 +596,126 @@ std::chrono::steady_clock::time_point Chunk::getLastActionTime() const {
 }
 
 bool Chunk::shouldUnload(bool ignoreTime) const {
-	return canUnload && (ignoreTime || std::chrono::steady_clock::now() - lastAction > std::chrono::minutes(1));
+	return unloadLocks == 0 && (ignoreTime || std::chrono::steady_clock::now() - lastAction > std::chrono::minutes(1));
 }
 
+// calls with true and false must be paired
 void Chunk::preventUnloading(bool state) {
-	canUnload = !state;
+	unloadLocks += state ? 1 : -1;
 }
 
 bool Chunk::isChunkEmpty() {
-	// very slow
-	for (u32 i = 0; i < protectionData.size(); i++) {
-		if (protectionData[i] != 0) {
-			return false;
-		}
+	if (nonZeroProtCells != 0) {
+		return false;
 	}
 
 	if (!protectionDataEmpty) {
 		protectionDataEmpty = true;
 		pngCacheOutdated = true;
 		pngFileOutdated = true;
+		++version;
 	}
 
-	RGB_u bgclr = ws.getBackgroundColor();
-	for (u32 y = 0; y < data.getHeight(); y++) {
-		for (u32 x = 0; x < data.getWidth(); x++) {
-			if (data.getPixel(x, y).rgb != bgclr.rgb) {
-				return false;
+	return nonBgPixels == 0;
+}
+
+void Chunk::countNonEmpty() {
+	// only needed when loading from disk, updated by setPixel and setProtectionGid later
+	if (!isIndexed()) {
+		nonBgPixels = countDifferentPixels(data.get(), Chunk::size * Chunk::size, bgClr);
+	} else if (int bgIdx = findPaletteIndex(packRgb(bgClr)); bgIdx >= 0) {
+		nonBgPixels = countDifferentBytes(data.get(), Chunk::size * Chunk::size, bgIdx);
+		// the palette could have the bg color repeated
+		for (sz_t i = bgIdx + 1; i < palette->size(); i++) {
+			if ((*palette)[i] == (*palette)[bgIdx]) {
+				nonBgPixels -= Chunk::size * Chunk::size - countDifferentBytes(data.get(), Chunk::size * Chunk::size, i);
 			}
 		}
+	} else {
+		nonBgPixels = Chunk::size * Chunk::size;
+	}
+
+	nonZeroProtCells = countDifferentCells(protectionData.data(), protectionData.size(), 0);
+}
+
+void Chunk::materialize() {
+	// indexed, all pixels point to the bg color. encodes of the solid png
+	// that are still running mark everything dirty again when they finish
+	auto plt(std::make_shared<std::vector<u32>>());
+	plt->reserve(256);
+	plt->assign(1, packRgb(bgClr));
+	std::shared_ptr<u8[]> px(new u8[Chunk::size * Chunk::size]());
+	{
+		std::lock_guard<std::mutex> _(bufMtx);
+		data = std::move(px);
+		palette = std::move(plt);
+	}
+
+	pngEncoder.markAllDirty();
+}
+
+void Chunk::promoteToRgb() {
+	// the palette is full. encodes reading the old buffer keep it alive
+	std::shared_ptr<u8[]> rgb(new u8[Chunk::size * Chunk::size * 3]);
+	const u8 * src = data.get();
+	u8 * dst = rgb.get();
+	for (sz_t i = 0; i < Chunk::size * Chunk::size; i++, dst += 3) {
+		u32 c = (*palette)[src[i]];
+		dst[0] = c;
+		dst[1] = c >> 8;
+		dst[2] = c >> 16;
+	}
+
+	{
+		std::lock_guard<std::mutex> _(bufMtx);
+		data = std::move(rgb);
+		palette = std::make_shared<std::vector<u32>>();
+	}
+
+	pngEncoder.markAllDirty();
+}
+
+u32 Chunk::getPackedPixel(u16 x, u16 y) const {
+	sz_t i = static_cast<sz_t>(y) * Chunk::size + x;
+	return isIndexed() ? (*palette)[data[i]] : packRgb(&data[i * 3]);
+}
+
+void Chunk::putPackedPixel(u16 x, u16 y, u32 clr) {
+	sz_t i = static_cast<sz_t>(y) * Chunk::size + x;
+	if (isIndexed()) {
+		int idx = findPaletteIndex(clr);
+		if (idx < 0 && palette->size() < 256) {
+			// encodes copy the palette with bufMtx held
+			std::lock_guard<std::mutex> _(bufMtx);
+			idx = palette->size();
+			palette->push_back(clr);
+		}
+
+		if (idx >= 0) {
+			data[i] = idx;
+			return;
+		}
+
+		promoteToRgb();
+	}
+
+	u8 * p = &data[i * 3];
+	p[0] = clr;
+	p[1] = clr >> 8;
+	p[2] = clr >> 16;
+}
+
+int Chunk::findPaletteIndex(u32 clr) {
+	// drawing usually repeats the same color
+	if (paletteHint < palette->size() && (*palette)[paletteHint] == clr) {
+		return paletteHint;
+	}
+
+	auto it = std::find(palette->begin(), palette->end(), clr);
+	if (it == palette->end()) {
+		return -1;
 	}
 
-	return true;
+	paletteHint = it - palette->begin();
+	return paletteHint;
 }
@@ -2,6 +2,7 @@
 
 #include <array>
 #include <vector>
+#include <memory>
 #include <mutex>
 #include <chrono>
 #include <shared_mutex>
@@ -9,15 +10,19 @@
 
 #include <explints.hpp>
 #include <color.hpp>
-#include <PngImage.hpp>
 #include <utils.hpp>
 
+#include <IncrementalPngEncoder.hpp>
+
 class WorldStorage;
+class World;
 
 class Chunk {
 public:
 	using Pos = i32;
 	using ProtPos = i32;
+	// encoded pngs are never modified, so workers can keep using one after it's replaced
+	using Png = std::shared_ptr<const std::vector<u8>>;
 
 	static constexpr sz_t size = 512;
 	static constexpr sz_t protectionAreaSize = 16;
@@ -31,16 +36,35 @@ public:
 
 private:
 	mutable std::shared_timed_mutex sm;
+	std::mutex pngMtx; // held while encoding, for the encoder state
+	std::mutex bufMtx; // held briefly to replace data and palette, or to add a color
 	std::chrono::steady_clock::time_point lastAction;
+	Chunk * lruPrev; // position in the world's list of loaded chunks
+	Chunk * lruNext;
+	bool saveQueued; // in the world's write-behind queue
+	bool saving; // the file is being written by a worker
+	bool unloadAfterSave;
 	const Pos x;
 	const Pos y;
 	const WorldStorage& ws;
-	PngImage data;
+	const RGB_u bgClr; // world background color when the chunk was loaded
+	// data and palette are replaced together when the format changes,
+	// workers keep reading the ones they started with
+	std::shared_ptr<u8[]> data; // pixels, row by row. null if the chunk is solid bg
+	std::shared_ptr<std::vector<u32>> palette; // if not empty, data holds 8 bit indices to these colors
+	IncrementalPngEncoder pngEncoder;
 	std::array<u32, pc * pc> protectionData; // split one chunk to protection cells
 	// with specific per-world, or general uvias roles
-	std::vector<u8> pngCache; // could get big
-	bool canUnload;
+	Png pngCache; // could get big. only replaced from the main thread
+	std::vector<u8> protectionRle; // the cells compressed, as read or last written
+	u32 nonBgPixels; // kept updated to know if the chunk can be deleted
+	u32 nonZeroProtCells;
+	u64 version; // increased on every modification, stored in the region index
+	u8 paletteHint; // index of the last color looked up
+	u32 unloadLocks; // can't unload unless it's 0
+	bool loaded;
 	bool protectionDataEmpty; // only set to true if woPp chunk reader wasn't called
+	bool protectionRleOutdated; // protectionRle has to be compressed again
 	bool pngCacheOutdated;
 	bool pngFileOutdated;
 
@@ -48,16 +72,44 @@ public:
 	Chunk(Pos x, Pos y, const WorldStorage& ws);
 	~Chunk();
 
+	void load(); // reads the chunk file, can be called from a worker thread
+	void setLoaded(); // called from the main thread once load() finishes
+	bool isLoaded() const;
+
+	Pos getX() const;
+	Pos getY() const;
+
+	RGB_u getPixel(u16 x, u16 y) const;
 	bool setPixel(u16 x, u16 y, RGB_u);
+	bool isSolid() const;
+	bool isIndexed() const;
 
 	void setProtectionGid(ProtPos x, ProtPos y, u32 gid);
+	// returns false if every cell already had that gid
+	bool setProtectionArea(ProtPos x, ProtPos y, u32 w, u32 h, u32 gid);
+	// in the same format as the png's woPp chunk, empty if there's no protection data
+	std::vector<u8> getProtectionRle();
 	u32 getProtectionGid(ProtPos x, ProtPos y) const;
 
+	u64 getVersion() const;
+
 	bool isPngCacheOutdated() const;
 	void unsetCacheOutdatedFlag();
-	void updatePngCache();
-	const std::vector<u8>& getPngData() const;
-
+	// can be called from a worker thread, the cache is set from the main thread
+	Png encodePng();
+	void setPngData(Png);
+	const Png& getPngData() const; // null if it wasn't encoded yet
+
+	// writes the pixels scaled down to half the size, as RGB rows of stride bytes.
+	// can be called from a worker thread, like encodePng()
+	void downscale(u8 * out, sz_t stride);
+	// averages two RGB rows of Chunk::size pixels to one half as wide
+	static void halveRows(const u8 * a, const u8 * b, u8 * out);
+
+	bool isPngFileOutdated() const;
+	void setFileOutdatedFlag();
+	void unsetFileOutdatedFlag();
+	void writePngFile(const std::vector<u8>& png, u64 fileVersion);
 	bool save();
 
 	void updateLastActionTime();
@@ -67,4 +119,14 @@ public:
 	void preventUnloading(bool);
 
 	bool isChunkEmpty();
+
+private:
+	void countNonEmpty();
+	void materialize();
+	void promoteToRgb();
+	u32 getPackedPixel(u16 x, u16 y) const;
+	void putPackedPixel(u16 x, u16 y, u32 clr);
+	int findPaletteIndex(u32 clr);
+
+	friend World;
 };
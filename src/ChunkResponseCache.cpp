@@ -0,0 +1,75 @@
+#include "ChunkResponseCache.hpp"
+
+#include <iterator>
+
+// rough cost of an entry besides the png, with the list and map nodes
+static constexpr sz_t entryOverhead = 128;
+
+ChunkResponseCache::ChunkResponseCache(sz_t maxBytes)
+: usedBytes(0),
+  maxBytes(maxBytes) { }
+
+const std::vector<u8> * ChunkResponseCache::get(const World * w, u64 key, u64 version, u8 level) {
+	auto search = entries.find({w, level, key});
+	if (search == entries.end()) {
+		return nullptr;
+	}
+
+	auto it = search->second;
+	if (it->version != version) {
+		// the chunk changed since
+		remove(it);
+		return nullptr;
+	}
+
+	lru.splice(lru.begin(), lru, it);
+	return &it->png;
+}
+
+bool ChunkResponseCache::has(const World * w, u64 key, u64 version, u8 level) const {
+	auto search = entries.find({w, level, key});
+	return search != entries.end() && search->second->version == version;
+}
+
+void ChunkResponseCache::put(const World * w, u64 key, u64 version, const u8 * data, sz_t size, u8 level) {
+	// version 0 can't be told apart from other unversioned chunks
+	// and a single png shouldn't evict a big part of the cache
+	if (version == 0 || size + entryOverhead > maxBytes / 16) {
+		return;
+	}
+
+	erase(w, key, level);
+
+	while (!lru.empty() && usedBytes + size + entryOverhead > maxBytes) {
+		remove(std::prev(lru.end()));
+	}
+
+	lru.push_front({w, level, key, version, std::vector<u8>(data, data + size)});
+	entries.emplace(std::make_tuple(w, level, key), lru.begin());
+	usedBytes += size + entryOverhead;
+}
+
+void ChunkResponseCache::erase(const World * w, u64 key, u8 level) {
+	auto search = entries.find({w, level, key});
+	if (search != entries.end()) {
+		remove(search->second);
+	}
+}
+
+void ChunkResponseCache::eraseAll(const World * w) {
+	auto it = entries.lower_bound({w, 0, 0});
+	while (it != entries.end() && std::get<0>(it->first) == w) {
+		auto entry = it->second;
+		++it;
+		remove(entry);
+	}
+}
+
+sz_t ChunkResponseCache::getUsedBytes() const { return usedBytes; }
+sz_t ChunkResponseCache::getMaxBytes()  const { return maxBytes; }
+
+void ChunkResponseCache::remove(std::list<Entry>::iterator it) {
+	usedBytes -= it->png.size() + entryOverhead;
+	entries.erase({it->world, it->level, it->key});
+	lru.erase(it);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <map>
+#include <list>
+#include <vector>
+#include <tuple>
+
+#include <explints.hpp>
+
+class World;
+
+// PNG bodies of recently requested chunks and downscaled tiles, shared by all
+// worlds under one byte budget. Entries are tagged with the version they were
+// made from, and are only returned for that version. Main thread only.
+// level 0 is a chunk, level n a tile of 2^n * 2^n chunks scaled down to one.
+class ChunkResponseCache {
+	struct Entry {
+		const World * world;
+		u8 level;
+		u64 key;
+		u64 version;
+		std::vector<u8> png;
+	};
+
+	std::list<Entry> lru; // most recently used first
+	std::map<std::tuple<const World *, u8, u64>, std::list<Entry>::iterator> entries;
+	sz_t usedBytes;
+	sz_t maxBytes;
+
+public:
+	ChunkResponseCache(sz_t maxBytes);
+
+	ChunkResponseCache(const ChunkResponseCache&) = delete;
+
+	// returns null if there's no response for this version of the chunk
+	const std::vector<u8> * get(const World *, u64 key, u64 version, u8 level = 0);
+	bool has(const World *, u64 key, u64 version, u8 level = 0) const; // doesn't count as a use
+	void put(const World *, u64 key, u64 version, const u8 * data, sz_t size, u8 level = 0);
+	void erase(const World *, u64 key, u8 level = 0);
+	void eraseAll(const World *);
+
+	sz_t getUsedBytes() const;
+	sz_t getMaxBytes() const;
+
+private:
+	void remove(std::list<Entry>::iterator);
+};
@@ -49,6 +49,10 @@ Ip Client::getIp() const {
 	return ip;
 }
 
+sz_t Client::getBufferedAmount() {
+	return ws->getBufferedAmount();
+}
+
 uWS::WebSocket<true> * Client::getWs() {
 	return ws;
 }
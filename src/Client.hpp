@@ -31,6 +31,7 @@ public:
 	std::chrono::seconds getSecondsConnected() const;
 	std::chrono::steady_clock::time_point getLastActionTime() const;
 	Ip getIp() const;
+	sz_t getBufferedAmount();
 	uWS::WebSocket<true> * getWs();
 	Session& getSession();
 	Player& getPlayer();
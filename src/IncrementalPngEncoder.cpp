@@ -0,0 +1,200 @@
+#include "IncrementalPngEncoder.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+
+#include <zlib.h>
+
+namespace {
+
+// deflate state is big (~256KB), so it's shared by all encoders on a thread
+struct Deflater {
+	z_stream zs;
+	std::vector<u8> filtered;
+
+	Deflater() {
+		std::memset(&zs, 0, sizeof(zs));
+		// raw deflate, the zlib header and checksum are written by the encoder
+		if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			throw std::runtime_error("deflateInit2 failed");
+		}
+	}
+
+	~Deflater() {
+		deflateEnd(&zs);
+	}
+};
+
+thread_local Deflater deflater;
+
+constexpr u8 pngSignature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+constexpr u8 zlibHeader[2] = {0x78, 0x9C};
+constexpr u8 emptyFinalBlock[2] = {0x03, 0x00}; // fixed huffman block, only EOB
+
+void putU32(std::vector<u8>& out, u32 n) {
+	out.push_back(n >> 24);
+	out.push_back(n >> 16);
+	out.push_back(n >> 8);
+	out.push_back(n);
+}
+
+// returns the offset of the chunk type, where the crc starts
+sz_t beginChunk(std::vector<u8>& out, const char * name, u32 length) {
+	putU32(out, length);
+	sz_t start = out.size();
+	out.insert(out.end(), name, name + 4);
+	return start;
+}
+
+void endChunk(std::vector<u8>& out, sz_t start) {
+	putU32(out, crc32(crc32(0, Z_NULL, 0), out.data() + start, out.size() - start));
+}
+
+} // namespace
+
+IncrementalPngEncoder::Band::Band()
+: adler(1),
+  rawSize(0),
+  dirty(true) { }
+
+IncrementalPngEncoder::IncrementalPngEncoder(u32 width, u32 height)
+: width(width),
+  height(height),
+  bandCount((height + rowsPerBand - 1) / rowsPerBand),
+  bands(std::make_unique<Band[]>(bandCount)),
+  lastFormat(RGB) { }
+
+void IncrementalPngEncoder::markRowDirty(u32 y) {
+	bands[y / rowsPerBand].dirty.store(true, std::memory_order_relaxed);
+}
+
+void IncrementalPngEncoder::markAllDirty() {
+	for (u32 i = 0; i < bandCount; i++) {
+		bands[i].dirty.store(true, std::memory_order_relaxed);
+	}
+}
+
+void IncrementalPngEncoder::encode(std::vector<u8>& out, Format fmt, const RowGetter& getRow,
+		const PaletteGetter& getPalette, const char * auxChunkName, const u8 * auxData, sz_t auxSize) {
+	if (fmt != lastFormat) {
+		markAllDirty();
+		lastFormat = fmt;
+	}
+
+	u32 adler = adler32(0, Z_NULL, 0);
+	sz_t idatSize = sizeof(zlibHeader) + sizeof(emptyFinalBlock) + 4;
+
+	for (u32 i = 0; i < bandCount; i++) {
+		Band& b = bands[i];
+		// if a row is modified while deflating it will be marked dirty again
+		if (b.dirty.exchange(false)) {
+			deflateBand(b, i * rowsPerBand, fmt, getRow);
+		}
+
+		adler = adler32_combine(adler, b.adler, b.rawSize);
+		idatSize += b.deflated.size();
+	}
+
+	std::vector<u8> palette;
+	if (fmt == PALETTE) {
+		palette = getPalette();
+	}
+
+	out.clear();
+	out.reserve(sizeof(pngSignature) + 25 + (palette.size() ? palette.size() + 12 : 0)
+		+ (auxChunkName ? auxSize + 12 : 0) + idatSize + 12 + 12);
+	out.insert(out.end(), std::begin(pngSignature), std::end(pngSignature));
+
+	sz_t start = beginChunk(out, "IHDR", 13);
+	putU32(out, width);
+	putU32(out, height);
+	out.push_back(8); // bit depth
+	out.push_back(fmt); // color type
+	out.push_back(0); // compression method
+	out.push_back(0); // filter method
+	out.push_back(0); // interlace method
+	endChunk(out, start);
+
+	if (palette.size()) {
+		start = beginChunk(out, "PLTE", palette.size());
+		out.insert(out.end(), palette.begin(), palette.end());
+		endChunk(out, start);
+	}
+
+	if (auxChunkName && auxSize != 0) {
+		start = beginChunk(out, auxChunkName, auxSize);
+		out.insert(out.end(), auxData, auxData + auxSize);
+		endChunk(out, start);
+	}
+
+	start = beginChunk(out, "IDAT", idatSize);
+	out.insert(out.end(), std::begin(zlibHeader), std::end(zlibHeader));
+	for (u32 i = 0; i < bandCount; i++) {
+		const auto& d = bands[i].deflated;
+		out.insert(out.end(), d.begin(), d.end());
+	}
+
+	out.insert(out.end(), std::begin(emptyFinalBlock), std::end(emptyFinalBlock));
+	putU32(out, adler);
+	endChunk(out, start);
+
+	start = beginChunk(out, "IEND", 0);
+	endChunk(out, start);
+}
+
+void IncrementalPngEncoder::deflateBand(Band& b, u32 firstRow, Format fmt, const RowGetter& getRow) {
+	const u32 rowSize = fmt == RGB ? width * 3 : width;
+	const u32 lastRow = std::min(firstRow + rowsPerBand, height);
+	std::vector<u8>& filtered = deflater.filtered;
+	filtered.resize((lastRow - firstRow) * (rowSize + 1));
+
+	// the sub filter only depends on the current row, so rows of other bands
+	// don't need to be refiltered when a row changes
+	u8 * dst = filtered.data();
+	for (u32 y = firstRow; y < lastRow; y++) {
+		const u8 * row = getRow(y);
+		if (fmt == PALETTE) {
+			// filtering indices isn't useful
+			*dst++ = 0; // filter type: none
+			std::memcpy(dst, row, rowSize);
+		} else {
+			*dst++ = 1; // filter type: sub
+			std::memcpy(dst, row, 3);
+			for (u32 i = 3; i < rowSize; i++) {
+				dst[i] = row[i] - row[i - 3];
+			}
+		}
+
+		dst += rowSize;
+	}
+
+	b.rawSize = filtered.size();
+	b.adler = adler32(adler32(0, Z_NULL, 0), filtered.data(), filtered.size());
+
+	z_stream& zs = deflater.zs;
+	deflateReset(&zs);
+	b.deflated.resize(deflateBound(&zs, filtered.size()) + 16);
+	zs.next_in = filtered.data();
+	zs.avail_in = filtered.size();
+	zs.next_out = b.deflated.data();
+	zs.avail_out = b.deflated.size();
+
+	// the sync flush leaves the output byte-aligned, without a final block
+	while (true) {
+		if (deflate(&zs, Z_SYNC_FLUSH) == Z_STREAM_ERROR) {
+			throw std::runtime_error("deflate failed");
+		}
+
+		if (zs.avail_out != 0) {
+			break;
+		}
+
+		sz_t written = b.deflated.size();
+		b.deflated.resize(written * 2);
+		zs.next_out = b.deflated.data() + written;
+		zs.avail_out = b.deflated.size() - written;
+	}
+
+	b.deflated.resize(b.deflated.size() - zs.avail_out);
+}
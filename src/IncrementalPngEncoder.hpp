@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
+
+#include <explints.hpp>
+
+// Encodes RGB or palette images to PNG, splitting the image data in horizontal bands
+// which are deflated separately (and byte-aligned with a sync flush), so that
+// only the bands containing modified rows need to be compressed again.
+// The compressed bands are concatenated in one zlib stream on every encode.
+class IncrementalPngEncoder {
+public:
+	// png color types
+	enum Format : u8 {
+		RGB = 2,
+		PALETTE = 3
+	};
+
+	// returns a pointer to the pixel data of the row y (width * 3 bytes, or width indices)
+	using RowGetter = std::function<const u8 *(u32 y)>;
+	// returns the RGB triplets of the palette, called after the rows are read
+	using PaletteGetter = std::function<std::vector<u8>()>;
+
+	static constexpr u32 rowsPerBand = 16;
+
+private:
+	struct Band {
+		std::vector<u8> deflated;
+		u32 adler;
+		u32 rawSize;
+		std::atomic<bool> dirty;
+
+		Band();
+	};
+
+	const u32 width;
+	const u32 height;
+	const u32 bandCount;
+	std::unique_ptr<Band[]> bands;
+	Format lastFormat;
+
+public:
+	IncrementalPngEncoder(u32 width, u32 height);
+
+	// can be called from a different thread than the encoding one
+	void markRowDirty(u32 y);
+	void markAllDirty();
+
+	// auxChunkName must be 4 chars long, the aux chunk will be placed before IDAT
+	void encode(std::vector<u8>& out, Format, const RowGetter&, const PaletteGetter& = nullptr,
+		const char * auxChunkName = nullptr, const u8 * auxData = nullptr, sz_t auxSize = 0);
+
+private:
+	void deflateBand(Band&, u32 firstRow, Format, const RowGetter&);
+};
@@ -0,0 +1,176 @@
+#include "InterestGrid.hpp"
+
+#include <algorithm>
+
+#include <Chunk.hpp>
+#include <config.hpp>
+#include <utils.hpp>
+
+static_assert((WORLD_INTEREST_CELL_CHUNKS & (WORLD_INTEREST_CELL_CHUNKS - 1)) == 0,
+	"WORLD_INTEREST_CELL_CHUNKS must be a power of two");
+
+static constexpr u32 cellShift = popc(WORLD_INTEREST_CELL_CHUNKS - 1);
+
+u64 InterestGrid::cellOf(i32 worldX, i32 worldY) {
+	return key(worldX >> (Chunk::posShift + cellShift), worldY >> (Chunk::posShift + cellShift));
+}
+
+std::pair<i32, i32> InterestGrid::firstChunkOf(u64 cell) {
+	return {i32(u32(cell >> 32)) << cellShift, i32(u32(cell)) << cellShift};
+}
+
+std::vector<u64> InterestGrid::setView(Player& pl, i32 x, i32 y, u32 w, u32 h) {
+	View nv{};
+	nv.x = x >> cellShift;
+	nv.y = y >> cellShift;
+	nv.lastX = (i64(x) + std::max(w, 1u) - 1) >> cellShift;
+	nv.lastY = (i64(y) + std::max(h, 1u) - 1) >> cellShift;
+
+	std::vector<u64> newCells;
+	auto it = views.find(&pl);
+	if (it != views.end()) {
+		View& ov = it->second;
+		if (ov.x == nv.x && ov.y == nv.y && ov.lastX == nv.lastX && ov.lastY == nv.lastY) {
+			return newCells;
+		}
+
+		for (i64 cy = ov.y; cy <= ov.lastY; cy++) {
+			for (i64 cx = ov.x; cx <= ov.lastX; cx++) {
+				if (!contains(nv, cx, cy)) {
+					removeFrom(&Cell::viewers, key(cx, cy), &pl);
+				}
+			}
+		}
+
+		nv.cursorCell = ov.cursorCell;
+		nv.cursorX = ov.cursorX;
+		nv.cursorY = ov.cursorY;
+	}
+
+	for (i64 cy = nv.y; cy <= nv.lastY; cy++) {
+		for (i64 cx = nv.x; cx <= nv.lastX; cx++) {
+			if (it == views.end() || !contains(it->second, cx, cy)) {
+				cells[key(cx, cy)].viewers.emplace_back(&pl);
+				newCells.emplace_back(key(cx, cy));
+			}
+		}
+	}
+
+	views.insert_or_assign(&pl, nv);
+	return newCells;
+}
+
+void InterestGrid::remove(Player& pl) {
+	auto it = views.find(&pl);
+	if (it == views.end()) {
+		return;
+	}
+
+	const View& v = it->second;
+	for (i64 cy = v.y; cy <= v.lastY; cy++) {
+		for (i64 cx = v.x; cx <= v.lastX; cx++) {
+			removeFrom(&Cell::viewers, key(cx, cy), &pl);
+		}
+	}
+
+	if (v.cursorCell) {
+		removeFrom(&Cell::cursors, *v.cursorCell, &pl);
+	}
+
+	views.erase(it);
+}
+
+std::vector<u64> InterestGrid::getViewCells(Player& pl) const {
+	std::vector<u64> vc;
+	auto it = views.find(&pl);
+	if (it == views.end()) {
+		return vc;
+	}
+
+	const View& v = it->second;
+	for (i64 cy = v.y; cy <= v.lastY; cy++) {
+		for (i64 cx = v.x; cx <= v.lastX; cx++) {
+			vc.emplace_back(key(cx, cy));
+		}
+	}
+
+	return vc;
+}
+
+const std::vector<Player *> * InterestGrid::getViewers(u64 cell) const {
+	auto it = cells.find(cell);
+	return it == cells.end() || it->second.viewers.empty() ? nullptr : &it->second.viewers;
+}
+
+const std::vector<Player *> * InterestGrid::getCursors(u64 cell) const {
+	auto it = cells.find(cell);
+	return it == cells.end() || it->second.cursors.empty() ? nullptr : &it->second.cursors;
+}
+
+InterestGrid::CursorMove InterestGrid::moveCursor(Player& pl, i32 x, i32 y) {
+	CursorMove mv;
+	mv.cell = cellOf(x, y);
+
+	auto it = views.find(&pl);
+	if (it == views.end()) {
+		return mv;
+	}
+
+	View& v = it->second;
+	if (v.cursorCell) {
+		mv.from = std::make_pair(v.cursorX, v.cursorY);
+	}
+
+	if (v.cursorCell != mv.cell) {
+		if (v.cursorCell) {
+			mv.leftCell = v.cursorCell;
+			removeFrom(&Cell::cursors, *v.cursorCell, &pl);
+		}
+
+		cells[mv.cell].cursors.emplace_back(&pl);
+		v.cursorCell = mv.cell;
+	}
+
+	v.cursorX = x;
+	v.cursorY = y;
+	return mv;
+}
+
+std::optional<std::pair<i32, i32>> InterestGrid::getSentCursorPos(Player& pl) const {
+	auto it = views.find(&pl);
+	if (it == views.end() || !it->second.cursorCell) {
+		return std::nullopt;
+	}
+
+	return std::make_pair(it->second.cursorX, it->second.cursorY);
+}
+
+sz_t InterestGrid::getCellCount() const {
+	return cells.size();
+}
+
+u64 InterestGrid::key(Pos x, Pos y) {
+	return u64(u32(x)) << 32 | u32(y);
+}
+
+bool InterestGrid::contains(const View& v, Pos x, Pos y) {
+	return x >= v.x && x <= v.lastX && y >= v.y && y <= v.lastY;
+}
+
+void InterestGrid::removeFrom(std::vector<Player *> Cell::* list, u64 cell, Player * pl) {
+	auto it = cells.find(cell);
+	if (it == cells.end()) {
+		return;
+	}
+
+	auto& v = it->second.*list;
+	auto pos = std::find(v.begin(), v.end(), pl);
+	if (pos != v.end()) {
+		*pos = v.back();
+		v.pop_back();
+	}
+
+	if (it->second.viewers.empty() && it->second.cursors.empty()) {
+		cells.erase(it);
+	}
+}
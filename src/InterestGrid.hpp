@@ -0,0 +1,67 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include <optional>
+#include <utility>
+
+#include <explints.hpp>
+
+class Player;
+
+// which players see each cell of a world, and which cursors are in it. players
+// subscribe to the cells touched by their viewport, cells are squares of
+// WORLD_INTEREST_CELL_CHUNKS chunks. main thread only
+class InterestGrid {
+public:
+	using Pos = i32; // in cells
+
+private:
+	struct Cell {
+		std::vector<Player *> viewers;
+		std::vector<Player *> cursors;
+	};
+
+	struct View {
+		Pos x;
+		Pos y;
+		Pos lastX; // inclusive
+		Pos lastY;
+		std::optional<u64> cursorCell; // where the cursor was last sent from
+		i32 cursorX;
+		i32 cursorY;
+	};
+
+	std::unordered_map<u64, Cell> cells;
+	std::unordered_map<Player *, View> views;
+
+public:
+	struct CursorMove {
+		u64 cell;
+		std::optional<u64> leftCell; // set if it was in another cell
+		std::optional<std::pair<i32, i32>> from; // the position last sent
+	};
+
+	static u64 cellOf(i32 worldX, i32 worldY);
+	static std::pair<i32, i32> firstChunkOf(u64 cell);
+
+	// x, y, w and h are in chunks, returns the cells that weren't seen before
+	std::vector<u64> setView(Player&, i32 x, i32 y, u32 w, u32 h);
+	void remove(Player&);
+	std::vector<u64> getViewCells(Player&) const;
+
+	// null if nobody sees the cell
+	const std::vector<Player *> * getViewers(u64 cell) const;
+	// null if there are no cursors in the cell
+	const std::vector<Player *> * getCursors(u64 cell) const;
+	// records the cursor position being sent
+	CursorMove moveCursor(Player&, i32 x, i32 y);
+	std::optional<std::pair<i32, i32>> getSentCursorPos(Player&) const;
+
+	sz_t getCellCount() const;
+
+private:
+	static u64 key(Pos x, Pos y);
+	static bool contains(const View&, Pos x, Pos y);
+	void removeFrom(std::vector<Player *> Cell::*, u64 cell, Player *);
+};
@@ -25,7 +25,9 @@ enum tc : u8 {
 	TOOL_STATE,
 	CHAT_MESSAGE,
 	PROTECTION_UPD,
-	STATS
+	STATS,
+	CHUNK_PROTECTION_UPD,
+	CHUNKS_STALE
 
 	/*TELEPORT, // use player data for this?
 	PERMISSIONS,
@@ -36,6 +38,18 @@ using Cursor = std::tuple<Player::Id, World::Pos, World::Pos, Player::Step, Play
 using Pixel  = std::tuple<World::Pos, World::Pos, u8, u8, u8>;
 using Bucket = std::tuple<Bucket::Rate, Bucket::Per, Bucket::Allowance>;
 
+// from client
+enum fc : u8 {
+	AREA_PROTECTION,
+	VIEWPORT,
+	PAINT,
+	CURSOR_MOVE,
+	CHAT,
+	PAINT_LINE,
+	PAINT_RECT,
+	PAINT_BLIT
+};
+
 } // namespace net
 
 // Packet definitions, clientbound
@@ -52,12 +66,32 @@ using PlayersHide = Packet<net::tc::HIDE_PLAYERS, std::vector<Player::Id>>;
 
 // world name, motd, bg color, drawing restricted, owner
 using WorldData        = Packet<net::tc::WORLD_DATA,     std::string, std::string, u32, bool, std::optional<User::Id>>;
-using WorldUpdate      = Packet<net::tc::WORLD_UPDATE,   std::vector<net::Cursor>, std::vector<net::Pixel>>;
+// players that left, cursors, pixels. the cursor and pixel lists are encoded as in UpdateEncoding.hpp
+using WorldUpdate      = Packet<net::tc::WORLD_UPDATE,   std::vector<Player::Id>, std::vector<u8>, std::vector<u8>>;
 #pragma message("Change Player class to Cursor")
 //using ToolState        = Packet<net::tc::TOOL_STATE,     Player::Id, >
 using ChatMessage      = Packet<net::tc::CHAT_MESSAGE,   User::Id, std::string>;
 using ProtectionUpdate = Packet<net::tc::PROTECTION_UPD, Chunk::ProtPos, Chunk::ProtPos, u32>;
 using Stats            = Packet<net::tc::STATS,          u32, u32>;
+// chunk x, y, protection cells of the whole chunk (rle, like in the png)
+using ChunkProtectionUpdate = Packet<net::tc::CHUNK_PROTECTION_UPD, Chunk::Pos, Chunk::Pos, std::vector<u8>>;
+// size, and the top left chunk of each size * size area that must be fetched again
+using ChunksStale      = Packet<net::tc::CHUNKS_STALE,   u8, std::vector<std::tuple<Chunk::Pos, Chunk::Pos>>>;
 
 // Packet definitions, serverbound
+// first cell x, y, width, height (in cells), protected
+using AreaProtection = Packet<net::fc::AREA_PROTECTION, Chunk::ProtPos, Chunk::ProtPos, u16, u16, bool>;
+// x, y, w, h of the chunks seen by the client
+using Viewport       = Packet<net::fc::VIEWPORT,        Chunk::Pos, Chunk::Pos, u8, u8>;
+// x, y, r, g, b
+using Paint          = Packet<net::fc::PAINT,           World::Pos, World::Pos, u8, u8, u8>;
+// x, y, step, tool
+using CursorMove     = Packet<net::fc::CURSOR_MOVE,     World::Pos, World::Pos, Player::Step, Player::Tid>;
+using Chat           = Packet<net::fc::CHAT,            std::string>;
+// x0, y0, x1, y1, r, g, b
+using PaintLine      = Packet<net::fc::PAINT_LINE,      World::Pos, World::Pos, World::Pos, World::Pos, u8, u8, u8>;
+// x, y, w, h, r, g, b (filled)
+using PaintRect      = Packet<net::fc::PAINT_RECT,      World::Pos, World::Pos, u16, u16, u8, u8, u8>;
+// x, y, w, h, mask (a bit per pixel, row by row, lsb first), rgb of the pixels set in the mask
+using PaintBlit      = Packet<net::fc::PAINT_BLIT,      World::Pos, World::Pos, u8, u8, std::vector<u8>, std::vector<u8>>;
 
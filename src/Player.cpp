@@ -3,11 +3,15 @@
 #include <memory>
 #include <iostream>
 #include <tuple>
+#include <limits>
+#include <algorithm>
+#include <cstdlib>
 
 #include <World.hpp>
 #include <Client.hpp>
 #include <User.hpp>
 #include <PacketDefinitions.hpp>
+#include <config.hpp>
 
 #include <nlohmann/json.hpp>
 
@@ -84,6 +88,10 @@ Player::Step Player::getStep() const {
 	return pixelStep;
 }
 
+Player::Tid Player::getToolId() const {
+	return toolId;
+}
+
 Player::Id Player::getPid() const {
 	return playerId;
 }
@@ -99,7 +107,94 @@ void Player::tell(const std::string& s) {
 }
 
 void Player::tryPaint(World::Pos x, World::Pos y, RGB_u rgb) {
-	world.paint(*this, x, y, rgb);
+	if (modifyWorldAllowed && paintLimiter.canSpend()) {
+		world.paint(*this, x, y, rgb);
+	}
+}
+
+// every point of the line, like bresenham's
+void Player::tryPaintLine(World::Pos x0, World::Pos y0, World::Pos x1, World::Pos y1, RGB_u rgb) {
+	const i64 dx = std::abs(i64(x1) - x0);
+	const i64 dy = -std::abs(i64(y1) - y0);
+	if (std::max(dx, -dy) >= WORLD_MAX_BULK_PAINT_PIXELS) {
+		return;
+	}
+
+	const i64 sx = x0 < x1 ? 1 : -1;
+	const i64 sy = y0 < y1 ? 1 : -1;
+	i64 x = x0;
+	i64 y = y0;
+	i64 err = dx + dy;
+
+	std::vector<pixupd_t> px;
+	px.reserve(std::max(dx, -dy) + 1);
+	while (true) {
+		px.push_back({playerId, World::Pos(x), World::Pos(y), rgb.r, rgb.g, rgb.b});
+		if (x == x1 && y == y1) {
+			break;
+		}
+
+		i64 e2 = 2 * err;
+		if (e2 >= dy) {
+			err += dy;
+			x += sx;
+		}
+
+		if (e2 <= dx) {
+			err += dx;
+			y += sy;
+		}
+	}
+
+	tryPaintPixels(std::move(px));
+}
+
+void Player::tryPaintRect(World::Pos x, World::Pos y, u16 w, u16 h, RGB_u rgb) {
+	if (u32(w) * h > WORLD_MAX_BULK_PAINT_PIXELS
+			|| i64(x) + w > std::numeric_limits<World::Pos>::max()
+			|| i64(y) + h > std::numeric_limits<World::Pos>::max()) {
+		return;
+	}
+
+	std::vector<pixupd_t> px;
+	px.reserve(u32(w) * h);
+	for (u32 j = 0; j < h; j++) {
+		for (u32 i = 0; i < w; i++) {
+			px.push_back({playerId, World::Pos(x + i), World::Pos(y + j), rgb.r, rgb.g, rgb.b});
+		}
+	}
+
+	tryPaintPixels(std::move(px));
+}
+
+void Player::tryPaintBlit(World::Pos x, World::Pos y, u8 w, u8 h, const std::vector<u8>& mask, const std::vector<u8>& rgb) {
+	const u32 area = u32(w) * h;
+	if (mask.size() != (area + 7) / 8 || rgb.size() % 3 != 0 || rgb.size() / 3 > WORLD_MAX_BULK_PAINT_PIXELS
+			|| i64(x) + w > std::numeric_limits<World::Pos>::max()
+			|| i64(y) + h > std::numeric_limits<World::Pos>::max()) {
+		return;
+	}
+
+	std::vector<pixupd_t> px;
+	px.reserve(rgb.size() / 3);
+	for (u32 i = 0; i < area; i++) {
+		if (!(mask[i / 8] >> (i % 8) & 1)) {
+			continue;
+		}
+
+		const sz_t c = px.size() * 3;
+		if (c + 3 > rgb.size()) {
+			return; // less colors than pixels in the mask
+		}
+
+		px.push_back({playerId, World::Pos(x + i % w), World::Pos(y + i / w), rgb[c], rgb[c + 1], rgb[c + 2]});
+	}
+
+	if (px.size() * 3 != rgb.size()) {
+		return;
+	}
+
+	tryPaintPixels(std::move(px));
 }
 
 void Player::tryMoveTo(World::Pos newX, World::Pos newY, Step prec, Tid newToolId) {
@@ -111,13 +206,22 @@ void Player::tryMoveTo(World::Pos newX, World::Pos newY, Step prec, Tid newToolI
 }
 
 void Player::tryChat(const std::string& s) {
-	world.chat(*this, std::move(s));
+	if (chatAllowed && !s.empty() && s.size() <= CLIENT_MAX_CHAT_LENGTH && chatLimiter.canSpend()) {
+		world.chat(*this, s);
+	}
 }
 
 void Player::send(const PrepMsg& p) {
 	cl.send(p);
 }
 
+// the whole shape is paid for at once, or not painted at all
+void Player::tryPaintPixels(std::vector<pixupd_t> px) {
+	if (!px.empty() && modifyWorldAllowed && paintLimiter.canSpend(u16(px.size()))) {
+		world.paint(*this, std::move(px));
+	}
+}
+
 bool Player::operator ==(const Player& p) const {
 	// XXX: why would you compare players from different worlds?
 	return playerId == p.playerId;
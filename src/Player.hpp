@@ -1,10 +1,12 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 #include <explints.hpp>
 #include <color.hpp>
 #include <Bucket.hpp>
+#include <types.hpp>
 
 class World; // using World::Pos = i32;
 using WorldPos = i32;
@@ -56,12 +58,17 @@ public:
 	WorldPos getX() const;
 	WorldPos getY() const;
 	Step getStep() const;
+	Tid getToolId() const;
 	Id getPid() const;
 
 	void teleportTo(WorldPos x, WorldPos y);
 	void tell(const std::string&);
 
 	void tryPaint(WorldPos x, WorldPos y, RGB_u);
+	void tryPaintLine(WorldPos x0, WorldPos y0, WorldPos x1, WorldPos y1, RGB_u);
+	void tryPaintRect(WorldPos x, WorldPos y, u16 w, u16 h, RGB_u);
+	// mask has a bit per pixel, rgb the colors of the pixels set in it
+	void tryPaintBlit(WorldPos x, WorldPos y, u8 w, u8 h, const std::vector<u8>& mask, const std::vector<u8>& rgb);
 	void tryMoveTo(WorldPos x, WorldPos y, Step precision, Tid toolId);
 	void tryChat(const std::string&);
 
@@ -69,6 +76,9 @@ public:
 
 	bool operator ==(const Player&) const;
 	bool operator  <(const Player&) const;
+
+private:
+	void tryPaintPixels(std::vector<pixupd_t>);
 };
 
 class Player::Builder {
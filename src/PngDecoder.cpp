@@ -0,0 +1,243 @@
+#include "PngDecoder.hpp"
+
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+#include <zlib.h>
+
+namespace {
+
+constexpr u8 pngSignature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+
+struct Inflater {
+	z_stream zs;
+
+	Inflater() {
+		std::memset(&zs, 0, sizeof(zs));
+		if (inflateInit(&zs) != Z_OK) {
+			throw std::runtime_error("inflateInit failed");
+		}
+	}
+
+	~Inflater() {
+		inflateEnd(&zs);
+	}
+};
+
+u32 getU32(const u8 * p) {
+	return u32(p[0]) << 24 | u32(p[1]) << 16 | u32(p[2]) << 8 | p[3];
+}
+
+u8 paeth(u8 a, u8 b, u8 c) {
+	int p = a + b - c;
+	int pa = std::abs(p - a);
+	int pb = std::abs(p - b);
+	int pc = std::abs(p - c);
+	if (pa <= pb && pa <= pc) {
+		return a;
+	}
+
+	return pb <= pc ? b : c;
+}
+
+// row[0] is the filter type, the pixel data follows
+void unfilter(u8 * row, const u8 * prev, sz_t size, u8 bpp) {
+	u8 * c = row + 1;
+	const u8 * p = prev + 1;
+	size -= 1;
+
+	switch (row[0]) {
+		case 0:
+			break;
+
+		case 1:
+			for (sz_t i = bpp; i < size; i++) {
+				c[i] += c[i - bpp];
+			}
+			break;
+
+		case 2:
+			for (sz_t i = 0; i < size; i++) {
+				c[i] += p[i];
+			}
+			break;
+
+		case 3:
+			for (sz_t i = 0; i < bpp; i++) {
+				c[i] += p[i] >> 1;
+			}
+
+			for (sz_t i = bpp; i < size; i++) {
+				c[i] += (c[i - bpp] + p[i]) >> 1;
+			}
+			break;
+
+		case 4:
+			for (sz_t i = 0; i < bpp; i++) {
+				c[i] += p[i];
+			}
+
+			for (sz_t i = bpp; i < size; i++) {
+				c[i] += paeth(c[i - bpp], p[i], p[i - bpp]);
+			}
+			break;
+
+		default:
+			throw std::runtime_error("Invalid PNG filter type");
+	}
+}
+
+} // namespace
+
+PngDecoder::PngDecoder()
+: width(0),
+  height(0),
+  colorType(RGB),
+  channels(3) { }
+
+void PngDecoder::setChunkReader(std::string name, ChunkReader f) {
+	chunkReaders.insert_or_assign(std::move(name), std::move(f));
+}
+
+bool PngDecoder::decode(u8 * data, sz_t size, const RowReader& onRow) {
+	if (size < sizeof(pngSignature) || std::memcmp(data, pngSignature, sizeof(pngSignature)) != 0) {
+		throw std::runtime_error("Not a PNG file");
+	}
+
+	Inflater inf;
+	z_stream& zs = inf.zs;
+	std::vector<u8> cur;
+	std::vector<u8> prev;
+	sz_t rowSize = 0;
+	sz_t rowFill = 0;
+	u32 row = 0;
+	bool gotHeader = false;
+
+	sz_t pos = sizeof(pngSignature);
+	while (size - pos >= 12) {
+		const u32 len = getU32(data + pos);
+		std::string_view type(reinterpret_cast<const char *>(data + pos + 4), 4);
+		u8 * body = data + pos + 8;
+		if (len > size - pos - 12) {
+			throw std::runtime_error("PNG chunk length out of bounds");
+		}
+
+		pos += len + 12;
+
+		if (type == "IHDR") {
+			if (len != 13) {
+				throw std::runtime_error("Invalid PNG header");
+			}
+
+			width = getU32(body);
+			height = getU32(body + 4);
+			colorType = static_cast<ColorType>(body[9]);
+			// bit depth, compression, filter and interlace methods
+			if (body[8] != 8 || body[10] != 0 || body[11] != 0 || body[12] != 0) {
+				return false;
+			}
+
+			switch (colorType) {
+				case GRAY:       channels = 1; break;
+				case RGB:        channels = 3; break;
+				case PALETTE:    channels = 1; break;
+				case GRAY_ALPHA: channels = 2; break;
+				case RGBA:       channels = 4; break;
+				default: return false;
+			}
+
+			rowSize = sz_t(width) * channels + 1;
+			cur.assign(rowSize, 0);
+			prev.assign(rowSize, 0);
+			gotHeader = true;
+		} else if (type == "PLTE") {
+			palette.assign(body, body + len - len % 3);
+		} else if (type == "IDAT") {
+			if (!gotHeader) {
+				throw std::runtime_error("PNG data before header");
+			}
+
+			zs.next_in = body;
+			zs.avail_in = len;
+			while (row < height) {
+				zs.next_out = cur.data() + rowFill;
+				zs.avail_out = rowSize - rowFill;
+				int r = inflate(&zs, Z_NO_FLUSH);
+				if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
+					throw std::runtime_error("Corrupted PNG image data");
+				}
+
+				rowFill = rowSize - zs.avail_out;
+				if (rowFill == rowSize) {
+					unfilter(cur.data(), prev.data(), rowSize, channels);
+					onRow(row++, cur.data() + 1);
+					std::swap(cur, prev);
+					rowFill = 0;
+				} else if (r == Z_STREAM_END || zs.avail_in == 0) {
+					break;
+				}
+			}
+		} else if (type == "IEND") {
+			break;
+		} else {
+			auto search = chunkReaders.find(type);
+			if (search != chunkReaders.end() && !search->second(body, len)) {
+				throw std::runtime_error("PNG chunk reader failed");
+			}
+		}
+	}
+
+	if (!gotHeader || row != height) {
+		throw std::runtime_error("PNG image data incomplete");
+	}
+
+	return true;
+}
+
+u32 PngDecoder::getWidth() const {
+	return width;
+}
+
+u32 PngDecoder::getHeight() const {
+	return height;
+}
+
+PngDecoder::ColorType PngDecoder::getColorType() const {
+	return colorType;
+}
+
+const std::vector<u8>& PngDecoder::getPalette() const {
+	return palette;
+}
+
+void PngDecoder::rowToRgb(const u8 * row, u8 * out) const {
+	switch (colorType) {
+		case RGB:
+			std::memcpy(out, row, sz_t(width) * 3);
+			break;
+
+		case PALETTE:
+			for (u32 i = 0; i < width; i++, out += 3) {
+				sz_t p = sz_t(row[i]) * 3;
+				if (p + 2 < palette.size()) {
+					std::memcpy(out, &palette[p], 3);
+				} else {
+					std::memset(out, 0, 3);
+				}
+			}
+			break;
+
+		default: // gray and/or alpha channels
+			for (u32 i = 0; i < width; i++, out += 3, row += channels) {
+				if (colorType == RGBA) {
+					std::memcpy(out, row, 3);
+				} else {
+					std::memset(out, row[0], 3);
+				}
+			}
+			break;
+	}
+}
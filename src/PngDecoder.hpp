@@ -0,0 +1,51 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include <explints.hpp>
+
+// Streaming decoder for 8 bit, non-interlaced PNGs. Rows are handed out
+// unfiltered in the image's own color type, so palette images can be read
+// without expanding them to RGB.
+class PngDecoder {
+public:
+	// returning false will throw
+	using ChunkReader = std::function<bool(u8 *, sz_t)>;
+	using RowReader = std::function<void(u32 y, const u8 * row)>;
+
+	enum ColorType : u8 {
+		GRAY = 0,
+		RGB = 2,
+		PALETTE = 3,
+		GRAY_ALPHA = 4,
+		RGBA = 6
+	};
+
+private:
+	std::map<std::string, ChunkReader, std::less<>> chunkReaders;
+	std::vector<u8> palette; // RGB triplets
+	u32 width;
+	u32 height;
+	ColorType colorType;
+	u8 channels;
+
+public:
+	PngDecoder();
+
+	void setChunkReader(std::string name, ChunkReader);
+
+	// returns false if the image uses a format not supported by this decoder,
+	// throws std::runtime_error if it's corrupted
+	bool decode(u8 * data, sz_t size, const RowReader&);
+
+	u32 getWidth() const;
+	u32 getHeight() const;
+	ColorType getColorType() const;
+	const std::vector<u8>& getPalette() const;
+
+	// converts a row given to the RowReader to RGB
+	void rowToRgb(const u8 * row, u8 * out) const;
+};
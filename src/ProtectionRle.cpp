@@ -0,0 +1,243 @@
+#include "ProtectionRle.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <rle.hpp>
+
+static constexpr sz_t minRun = 3;
+
+static void putU16(u8 * p, u16 n) {
+	p[0] = n;
+	p[1] = n >> 8;
+}
+
+static u16 getU16(const u8 * p) {
+	return p[0] | p[1] << 8;
+}
+
+// equal items from the first one, at least 1
+static sz_t runLength(const u32 * p, sz_t count) {
+	sz_t i = 1;
+
+#ifdef __SSE2__
+	const __m128i v = _mm_set1_epi32(p[0]);
+	for (; i + 4 <= count; i += 4) {
+		u32 eq = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i)), v));
+		if (eq != 0xFFFF) {
+			return i + __builtin_ctz(~eq) / 4;
+		}
+	}
+#endif
+
+	while (i < count && p[i] == p[0]) {
+		i++;
+	}
+
+	return i;
+}
+
+// the first index from i where a run starts, or count
+static sz_t nextRun(const u32 * p, sz_t i, sz_t count) {
+	static_assert(minRun == 3, "nextRun only finds runs of 3");
+
+#ifdef __SSE2__
+	// 4 positions at a time, each compared to the next two items
+	for (; i + 6 <= count; i += 4) {
+		const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+		const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i + 1));
+		const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i + 2));
+		u32 starts = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi32(a, b), _mm_cmpeq_epi32(b, c)));
+		if (starts != 0) {
+			return i + __builtin_ctz(starts) / 4;
+		}
+	}
+#endif
+
+	for (; i + 2 < count; i++) {
+		if (p[i] == p[i + 1] && p[i] == p[i + 2]) {
+			return i;
+		}
+	}
+
+	return count;
+}
+
+static void fill(u32 * p, sz_t count, u32 v) {
+	sz_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i vv = _mm_set1_epi32(v);
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(p + i), vv);
+	}
+#endif
+
+	for (; i < count; i++) {
+		p[i] = v;
+	}
+}
+
+std::vector<u8> prle::compressFast(const u32 * items, sz_t count) {
+	// the data is written after room for the most runs there can be, and moved
+	// next to the run offsets at the end, so there's only one allocation
+	const sz_t maxRuns = count / minRun;
+	std::vector<u8> out(4 + maxRuns * 2 + count * sizeof(u32));
+	u8 * runs = out.data() + 4;
+	u8 * const data = runs + maxRuns * 2;
+	u8 * p = data;
+
+	for (sz_t i = 0; i < count;) {
+		sz_t len = runLength(items + i, count - i);
+		if (len >= minRun) {
+			putU16(runs, p - data);
+			runs += 2;
+			putU16(p, len);
+			std::memcpy(p + 2, &items[i], sizeof(u32));
+			p += 2 + sizeof(u32);
+			i += len;
+		} else {
+			// items are stored little endian, like in memory
+			sz_t end = nextRun(items, i, count);
+			std::memcpy(p, items + i, (end - i) * sizeof(u32));
+			p += (end - i) * sizeof(u32);
+			i = end;
+		}
+	}
+
+	putU16(out.data(), count);
+	putU16(out.data() + 2, (runs - out.data() - 4) / 2);
+	std::memmove(runs, data, p - data);
+	out.resize(runs - out.data() + (p - data));
+	return out;
+}
+
+bool prle::decompressFast(const u8 * d, sz_t size, u32 * items, sz_t count) {
+	if (size < 4 || getU16(d) != count) {
+		return false;
+	}
+
+	const sz_t runs = getU16(d + 2);
+	const sz_t dataStart = 4 + runs * 2;
+	if (dataStart > size) {
+		return false;
+	}
+
+	const u8 * data = d + dataStart;
+	const sz_t dataSize = size - dataStart;
+	sz_t pos = 0;
+	sz_t done = 0;
+	for (sz_t r = 0; r <= runs; r++) {
+		// the items before the run, or until the end
+		const sz_t runPos = r < runs ? getU16(d + 4 + r * 2) : dataSize;
+		if (runPos < pos || runPos > dataSize || (runPos - pos) % sizeof(u32) != 0
+				|| (runPos - pos) / sizeof(u32) > count - done) {
+			return false;
+		}
+
+		if (runPos != pos) {
+			std::memcpy(items + done, data + pos, runPos - pos);
+		}
+
+		done += (runPos - pos) / sizeof(u32);
+		pos = runPos;
+		if (r == runs) {
+			break;
+		}
+
+		if (pos + 2 + sizeof(u32) > dataSize) {
+			return false;
+		}
+
+		const sz_t len = getU16(data + pos);
+		u32 v;
+		std::memcpy(&v, data + pos + 2, sizeof(u32));
+		pos += 2 + sizeof(u32);
+		if (len > count - done) {
+			return false;
+		}
+
+		fill(items + done, len, v);
+		done += len;
+	}
+
+	return done == count;
+}
+
+static bool matchesRle(const std::vector<u32>& items) {
+	try {
+		auto ref = rle::compress(items.data(), items.size());
+		std::vector<u8> fast(prle::compressFast(items.data(), items.size()));
+		if (fast.size() != ref.second || std::memcmp(fast.data(), ref.first.get(), ref.second) != 0) {
+			return false;
+		}
+
+		std::vector<u32> decoded(items.size());
+		return prle::decompressFast(ref.first.get(), ref.second, decoded.data(), decoded.size())
+			&& decoded == items;
+	} catch (const std::exception&) {
+		return false;
+	}
+}
+
+bool prle::isFastCompatible() {
+	static const bool compatible = [] {
+		// the size of a chunk's protections, and the cases where an encoder
+		// could choose differently: short runs, runs at the ends, no runs
+		const sz_t n = 1024;
+		std::vector<std::vector<u32>> samples(7, std::vector<u32>(n));
+		std::fill(samples[1].begin(), samples[1].end(), 0xDEADBEEF);
+		u32 seed = 1;
+		for (sz_t i = 0; i < n; i++) {
+			seed = seed * 1103515245 + 12345;
+			samples[2][i] = i;
+			samples[3][i] = i / 2;
+			samples[4][i] = i / 3;
+			samples[5][i] = (seed >> 16) % 4 == 0 ? seed : 0;
+			samples[6][i] = (i / 32 + i % 32 / 8) % 3;
+		}
+
+		for (const auto& s : samples) {
+			if (!matchesRle(s)) {
+				std::cerr << "Protection RLE: rle.hpp output differs, not using the SSE2 codec" << std::endl;
+				return false;
+			}
+		}
+
+		return true;
+	}();
+
+	return compatible;
+}
+
+std::vector<u8> prle::compress(const u32 * items, sz_t count) {
+	if (count <= maxFastItems && isFastCompatible()) {
+		return compressFast(items, count);
+	}
+
+	auto rle = rle::compress(items, count);
+	return std::vector<u8>(rle.first.get(), rle.first.get() + rle.second);
+}
+
+bool prle::decompress(const u8 * data, sz_t size, u32 * items, sz_t count) {
+	if (count <= maxFastItems && isFastCompatible()) {
+		return decompressFast(data, size, items, count);
+	}
+
+	try {
+		if (rle::getItems<u32>(data, size) != count) {
+			return false;
+		}
+
+		rle::decompress(data, size, items, count);
+		return true;
+	} catch (const std::length_error&) {
+		return false;
+	}
+}
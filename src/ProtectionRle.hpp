@@ -0,0 +1,28 @@
+#pragma once
+
+#include <vector>
+
+#include <explints.hpp>
+
+// the protection cells of a chunk, as stored in the woPp png chunk and sent in
+// ChunkProtectionUpdate, in the format of rle.hpp:
+//  u16 item count, u16 run count, a u16 per run with its byte offset in the data,
+//  then the data: the items as is, except for runs of 3 or more equal items,
+//  which are a u16 length and the item. everything is little endian
+// runs are found and filled with SSE2. the first time they're needed, the fast
+// functions are checked to give the same bytes as rle.hpp, if they don't,
+// compress and decompress use rle.hpp instead
+namespace prle {
+
+std::vector<u8> compress(const u32 * items, sz_t count);
+// returns false if the data is corrupt or doesn't have exactly count items
+bool decompress(const u8 * data, sz_t size, u32 * items, sz_t count);
+
+// without the compatibility check, count can't be more than maxFastItems
+constexpr sz_t maxFastItems = 0xFFFF / sizeof(u32);
+std::vector<u8> compressFast(const u32 * items, sz_t count);
+bool decompressFast(const u8 * data, sz_t size, u32 * items, sz_t count);
+// compares the fast functions to rle.hpp once
+bool isFastCompatible();
+
+} // namespace prle
@@ -0,0 +1,613 @@
+#include "RegionFile.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <iterator>
+#include <limits>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <utils.hpp>
+
+namespace {
+
+constexpr char magic[8] = {'w', 'o', 'P', 'r', 'e', 'g', 'n', '\0'};
+constexpr u32 version = 2;
+
+// don't bother compacting files wasting less than this
+constexpr u32 minCompactWaste = 1024 * 1024;
+
+void readAll(int fd, void * buf, sz_t size, off_t offset, const std::string& path) {
+	u8 * p = static_cast<u8 *>(buf);
+	while (size > 0) {
+		ssize_t r = pread(fd, p, size, offset);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR) {
+				continue;
+			}
+
+			throw std::runtime_error("Couldn't read region file " + path + ": "
+				+ (r == 0 ? "unexpected end of file" : std::strerror(errno)));
+		}
+
+		p += r;
+		size -= r;
+		offset += r;
+	}
+}
+
+void writeAll(int fd, const void * buf, sz_t size, off_t offset, const std::string& path) {
+	const u8 * p = static_cast<const u8 *>(buf);
+	while (size > 0) {
+		ssize_t r = pwrite(fd, p, size, offset);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			throw std::runtime_error("Couldn't write region file " + path + ": " + std::strerror(errno));
+		}
+
+		p += r;
+		size -= r;
+		offset += r;
+	}
+}
+
+} // namespace
+
+RegionFile::View::View()
+: region(nullptr),
+  mapping(nullptr),
+  mappingSize(0),
+  ptr(nullptr),
+  length(0),
+  offset(0),
+  generation(0) { }
+
+RegionFile::View::View(const RegionFile * region, u8 * mapping, sz_t mappingSize,
+		sz_t dataOffset, u32 offset, u32 length, u32 generation)
+: region(region),
+  mapping(mapping),
+  mappingSize(mappingSize),
+  ptr(mapping + dataOffset),
+  length(length),
+  offset(offset),
+  generation(generation) { }
+
+RegionFile::View::View(View&& v) noexcept
+: View() {
+	*this = std::move(v);
+}
+
+RegionFile::View::~View() {
+	reset();
+}
+
+RegionFile::View& RegionFile::View::operator=(View&& v) noexcept {
+	if (this != &v) {
+		reset();
+		region = v.region;
+		mapping = v.mapping;
+		mappingSize = v.mappingSize;
+		ptr = v.ptr;
+		length = v.length;
+		offset = v.offset;
+		generation = v.generation;
+		v.region = nullptr;
+		v.mapping = nullptr;
+	}
+
+	return *this;
+}
+
+u8 * RegionFile::View::data() const {
+	return ptr;
+}
+
+sz_t RegionFile::View::size() const {
+	return length;
+}
+
+RegionFile::View::operator bool() const {
+	return mapping != nullptr;
+}
+
+void RegionFile::View::prefault() const {
+	static const sz_t pageSize = sysconf(_SC_PAGESIZE);
+	madvise(mapping, mappingSize, MADV_WILLNEED);
+	volatile u8 sink = 0;
+	for (sz_t i = 0; i < mappingSize; i += pageSize) {
+		sink = sink + mapping[i];
+	}
+}
+
+void RegionFile::View::reset() {
+	if (mapping) {
+		munmap(mapping, mappingSize);
+		region->unpin(offset, generation);
+		mapping = nullptr;
+		region = nullptr;
+	}
+}
+
+RegionFile::RegionFile(std::string path)
+: path(std::move(path)),
+  fd(-1),
+  fileEnd(headerSize),
+  usedBytes(0),
+  storedChunks(0),
+  generation(0),
+  inOpenList(false) {
+	if (fileExists(this->path)) {
+		index.resize(chunks); // openFile() only opens existing regions
+		openFile();
+		try {
+			loadIndex();
+		} catch (...) {
+			close(fd);
+			throw;
+		}
+	}
+}
+
+RegionFile::~RegionFile() {
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+u32 RegionFile::indexOf(i32 chunkX, i32 chunkY) {
+	return (u32(chunkY) & (side - 1)) * side + (u32(chunkX) & (side - 1));
+}
+
+bool RegionFile::has(u32 i) const {
+	std::shared_lock<std::shared_timed_mutex> _(sm);
+	return !index.empty() && index[i].size != 0;
+}
+
+bool RegionFile::hasAnyIn(u32 i, u32 n) const {
+	std::shared_lock<std::shared_timed_mutex> _(sm);
+	if (index.empty()) {
+		return false;
+	}
+
+	for (u32 y = 0; y < n; y++) {
+		for (u32 x = 0; x < n; x++) {
+			if (index[i + y * side + x].size != 0) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+u64 RegionFile::getVersion(u32 i) const {
+	std::shared_lock<std::shared_timed_mutex> _(sm);
+	return index.empty() || index[i].size == 0 ? 0 : index[i].version;
+}
+
+bool RegionFile::read(u32 i, std::vector<u8>& out) const {
+	std::shared_lock<std::shared_timed_mutex> lk(sm);
+	acquireFd(lk);
+	if (index.empty() || index[i].size == 0) {
+		return false;
+	}
+
+	const Entry e = index[i];
+	out.resize(e.size);
+	readAll(fd, out.data(), e.size, e.offset, path);
+	return true;
+}
+
+RegionFile::View RegionFile::map(u32 i) const {
+	static const sz_t pageSize = sysconf(_SC_PAGESIZE);
+	std::shared_lock<std::shared_timed_mutex> lk(sm);
+	acquireFd(lk);
+	if (index.empty() || index[i].size == 0) {
+		return View();
+	}
+
+	const Entry e = index[i];
+	const off_t start = e.offset - e.offset % pageSize;
+	const sz_t dataOffset = e.offset - start;
+	const sz_t mappingSize = dataOffset + e.size;
+	void * m = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, start);
+	if (m == MAP_FAILED) {
+		throw std::runtime_error("Couldn't map region file " + path + ": " + std::strerror(errno));
+	}
+
+	// writers change the index with a unique lock, so the entry can't be released before this
+	std::lock_guard<std::mutex> _(pinMtx);
+	++pins[e.offset];
+	return View(this, static_cast<u8 *>(m), mappingSize, dataOffset, e.offset, e.size, generation);
+}
+
+void RegionFile::write(u32 i, const u8 * data, sz_t size, u64 version) {
+	if (size == 0 || size > std::numeric_limits<u32>::max() / 2) {
+		throw std::runtime_error("Invalid chunk size for region file " + path);
+	}
+
+	std::lock_guard<std::mutex> w(writeMtx);
+	if (index.empty()) {
+		createFile();
+	} else {
+		std::unique_lock<std::shared_timed_mutex> _(sm);
+		openFile();
+	}
+
+	releaseDeferred();
+
+	// the old data stays valid until the index points to the new copy
+	u32 offset = allocate(size);
+	writeAll(fd, data, size, offset, path);
+
+	Entry old;
+	{
+		std::unique_lock<std::shared_timed_mutex> _(sm);
+		old = index[i];
+		index[i] = {offset, u32(size), version};
+	}
+
+	writeEntry(i);
+	if (old.size != 0) {
+		release(old.offset, old.size);
+	} else {
+		++storedChunks;
+	}
+
+	usedBytes += size - old.size;
+}
+
+void RegionFile::erase(u32 i) {
+	std::lock_guard<std::mutex> w(writeMtx);
+	if (index.empty() || index[i].size == 0) {
+		return;
+	}
+
+	Entry old;
+	{
+		std::unique_lock<std::shared_timed_mutex> _(sm);
+		openFile();
+		old = index[i];
+		index[i] = {0, 0, 0};
+	}
+
+	if (--storedChunks == 0) {
+		removeFile();
+		return;
+	}
+
+	releaseDeferred();
+	writeEntry(i);
+	release(old.offset, old.size);
+	usedBytes -= old.size;
+}
+
+bool RegionFile::shouldCompact() const {
+	std::lock_guard<std::mutex> w(writeMtx);
+	u32 wasted = fileEnd - headerSize - usedBytes;
+	return wasted > minCompactWaste && wasted > usedBytes / 2;
+}
+
+// copies the chunks to a new file without gaps, and replaces the old one
+void RegionFile::compact() {
+	std::lock_guard<std::mutex> w(writeMtx);
+	if (index.empty()) {
+		return;
+	}
+
+	{
+		std::unique_lock<std::shared_timed_mutex> _(sm);
+		openFile();
+	}
+
+	std::string tmpPath(path + ".tmp");
+	int tmp = open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (tmp < 0) {
+		throw std::runtime_error("Couldn't create file " + tmpPath + ": " + std::strerror(errno));
+	}
+
+	std::vector<Entry> newIndex(chunks, Entry{0, 0, 0});
+	u32 pos = headerSize;
+	try {
+		std::vector<u8> buf;
+		for (u32 i = 0; i < chunks; i++) {
+			const Entry e = index[i];
+			if (e.size == 0) {
+				continue;
+			}
+
+			buf.resize(e.size);
+			readAll(fd, buf.data(), e.size, e.offset, path);
+			writeAll(tmp, buf.data(), e.size, pos, tmpPath);
+			newIndex[i] = {pos, e.size, e.version};
+			pos += e.size;
+		}
+
+		writeHeader(tmp, newIndex, tmpPath);
+
+		if (fsync(tmp) != 0 || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+			throw std::runtime_error("Couldn't replace region file " + path + ": " + std::strerror(errno));
+		}
+	} catch (...) {
+		close(tmp);
+		std::remove(tmpPath.c_str());
+		throw;
+	}
+
+	{
+		std::unique_lock<std::shared_timed_mutex> _(sm);
+		close(fd);
+		fd = tmp;
+		index = std::move(newIndex);
+	}
+
+	// views of the old file keep it alive, its space doesn't matter anymore
+	{
+		std::lock_guard<std::mutex> _(pinMtx);
+		++generation;
+		pins.clear();
+		deferredFrees.clear();
+	}
+
+	freeSpace.clear();
+	fileEnd = pos;
+}
+
+bool RegionFile::tryCloseFile() {
+	std::unique_lock<std::mutex> w(writeMtx, std::try_to_lock);
+	if (!w) {
+		return false;
+	}
+
+	std::unique_lock<std::shared_timed_mutex> l(sm, std::try_to_lock);
+	if (!l) {
+		return false;
+	}
+
+	if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+
+	return true;
+}
+
+void RegionFile::loadIndex() {
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		throw std::runtime_error("Couldn't stat region file " + path + ": " + std::strerror(errno));
+	}
+
+	u8 header[16];
+	u32 fileVersion;
+	u32 fileSide;
+	if (st.st_size < headerSize) {
+		throw std::runtime_error("Region file too small: " + path);
+	}
+
+	readAll(fd, header, sizeof(header), 0, path);
+	std::memcpy(&fileVersion, header + 8, sizeof(u32));
+	std::memcpy(&fileSide, header + 12, sizeof(u32));
+	if (std::memcmp(header, magic, sizeof(magic)) != 0 || fileVersion != version || fileSide != side) {
+		throw std::runtime_error("Invalid region file header: " + path);
+	}
+
+	readAll(fd, index.data(), chunks * sizeof(Entry), sizeof(header), path);
+
+	std::vector<Entry> used;
+	for (Entry& e : index) {
+		if (e.size == 0) {
+			continue;
+		}
+
+		if (e.offset < headerSize || u64(e.offset) + e.size > u64(st.st_size)) {
+			std::cerr << "Invalid chunk entry in region file " << path << ", ignoring." << std::endl;
+			e = {0, 0, 0};
+			continue;
+		}
+
+		used.push_back(e);
+		usedBytes += e.size;
+		++storedChunks;
+	}
+
+	// the gaps between the chunks are free space
+	std::sort(used.begin(), used.end(), [] (const Entry& a, const Entry& b) {
+		return a.offset < b.offset;
+	});
+
+	u32 pos = headerSize;
+	for (const Entry& e : used) {
+		if (e.offset > pos) {
+			freeSpace.emplace(pos, e.offset - pos);
+		}
+
+		pos = std::max(pos, e.offset + e.size);
+	}
+
+	fileEnd = pos;
+}
+
+// the caller must hold a unique lock of sm
+void RegionFile::openFile() const {
+	if (fd >= 0 || index.empty()) {
+		return;
+	}
+
+	fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::runtime_error("Couldn't open region file " + path + ": " + std::strerror(errno));
+	}
+}
+
+void RegionFile::createFile() {
+	int nfd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (nfd < 0) {
+		throw std::runtime_error("Couldn't create region file " + path + ": " + std::strerror(errno));
+	}
+
+	std::vector<Entry> newIndex(chunks, Entry{0, 0, 0});
+	try {
+		writeHeader(nfd, newIndex, path);
+	} catch (...) {
+		close(nfd);
+		throw;
+	}
+
+	std::unique_lock<std::shared_timed_mutex> _(sm);
+	fd = nfd;
+	index = std::move(newIndex);
+	freeSpace.clear();
+	fileEnd = headerSize;
+	usedBytes = 0;
+	storedChunks = 0;
+}
+
+// first fit, appends to the file if no gap is big enough
+u32 RegionFile::allocate(u32 size) {
+	for (auto it = freeSpace.begin(); it != freeSpace.end(); ++it) {
+		if (it->second >= size) {
+			u32 offset = it->first;
+			u32 rest = it->second - size;
+			freeSpace.erase(it);
+			if (rest != 0) {
+				freeSpace.emplace(offset + size, rest);
+			}
+
+			return offset;
+		}
+	}
+
+	if (fileEnd > std::numeric_limits<u32>::max() - size) {
+		throw std::runtime_error("Region file full: " + path);
+	}
+
+	u32 offset = fileEnd;
+	fileEnd += size;
+	return offset;
+}
+
+void RegionFile::release(u32 offset, u32 size) {
+	{
+		std::lock_guard<std::mutex> _(pinMtx);
+		if (pins.count(offset)) {
+			// still mapped somewhere, released by the next writer after it's unmapped
+			deferredFrees.push_back({offset, size, 0});
+			return;
+		}
+	}
+
+	// merge with the neighbouring gaps
+	auto next = freeSpace.lower_bound(offset);
+	if (next != freeSpace.end() && offset + size == next->first) {
+		size += next->second;
+		next = freeSpace.erase(next);
+	}
+
+	if (next != freeSpace.begin()) {
+		auto prev = std::prev(next);
+		if (prev->first + prev->second == offset) {
+			offset = prev->first;
+			size += prev->second;
+			freeSpace.erase(prev);
+		}
+	}
+
+	if (offset + size == fileEnd) {
+		fileEnd = offset;
+		if (ftruncate(fd, fileEnd) != 0) {
+			std::perror(("Couldn't truncate region file " + path).c_str());
+		}
+	} else {
+		freeSpace.emplace(offset, size);
+	}
+}
+
+void RegionFile::releaseDeferred() {
+	std::vector<Entry> unpinned;
+	{
+		std::lock_guard<std::mutex> _(pinMtx);
+		auto it = std::partition(deferredFrees.begin(), deferredFrees.end(), [this] (const Entry& e) {
+			return pins.count(e.offset) != 0;
+		});
+
+		unpinned.assign(it, deferredFrees.end());
+		deferredFrees.erase(it, deferredFrees.end());
+	}
+
+	for (const Entry& e : unpinned) {
+		release(e.offset, e.size);
+	}
+}
+
+void RegionFile::unpin(u32 offset, u32 gen) const {
+	std::lock_guard<std::mutex> _(pinMtx);
+	if (gen != generation) {
+		return; // mapped from a replaced file
+	}
+
+	auto search = pins.find(offset);
+	if (search != pins.end() && --search->second == 0) {
+		pins.erase(search);
+	}
+}
+
+// reopens the file if it was closed, lk must be locked
+void RegionFile::acquireFd(std::shared_lock<std::shared_timed_mutex>& lk) const {
+	while (fd < 0 && !index.empty()) {
+		lk.unlock();
+		{
+			std::unique_lock<std::shared_timed_mutex> _(sm);
+			openFile();
+		}
+		lk.lock();
+	}
+}
+
+void RegionFile::writeHeader(int fd, const std::vector<Entry>& idx, const std::string& path) {
+	u8 header[16] = {0};
+	std::memcpy(header, magic, sizeof(magic));
+	std::memcpy(header + 8, &version, sizeof(u32));
+	std::memcpy(header + 12, &side, sizeof(u32));
+	writeAll(fd, header, sizeof(header), 0, path);
+	writeAll(fd, idx.data(), chunks * sizeof(Entry), sizeof(header), path);
+}
+
+void RegionFile::writeEntry(u32 i) {
+	writeAll(fd, &index[i], sizeof(Entry), 16 + i * sizeof(Entry), path);
+}
+
+void RegionFile::removeFile() {
+	{
+		std::unique_lock<std::shared_timed_mutex> _(sm);
+		close(fd);
+		fd = -1;
+		index.clear();
+	}
+
+	{
+		std::lock_guard<std::mutex> _(pinMtx);
+		++generation;
+		pins.clear();
+		deferredFrees.clear();
+	}
+
+	freeSpace.clear();
+	fileEnd = headerSize;
+	usedBytes = 0;
+	storedChunks = 0;
+
+	if (std::remove(path.c_str())) {
+		std::perror(("Couldn't delete region file " + path).c_str());
+	}
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <mutex>
+#include <shared_mutex>
+
+#include <explints.hpp>
+
+// Container for the files of a square of side * side chunks. The header holds an
+// offset and length for every chunk, rewritten chunks are placed in free space
+// (or appended), and the old data is only released after the index points
+// to the new copy. Reads can happen while another thread writes.
+class RegionFile {
+public:
+	static constexpr u32 side = 32;
+	static constexpr u32 shift = 5;
+	static constexpr u32 chunks = side * side;
+
+	// the data of a chunk mapped to memory, its space in the file isn't reused
+	// until the view is destroyed. the pages are private, writes don't reach the file
+	class View {
+		const RegionFile * region;
+		u8 * mapping;
+		sz_t mappingSize;
+		u8 * ptr;
+		u32 length;
+		u32 offset;
+		u32 generation;
+
+	public:
+		View();
+		View(const RegionFile *, u8 * mapping, sz_t mappingSize, sz_t dataOffset, u32 offset, u32 length, u32 generation);
+		View(View&&) noexcept;
+		~View();
+
+		View& operator=(View&&) noexcept;
+
+		u8 * data() const;
+		sz_t size() const;
+		explicit operator bool() const;
+
+		// reads every page, so that using the data later doesn't block on the disk
+		void prefault() const;
+		// unmaps and unpins the data, the region file must still exist
+		void reset();
+	};
+
+private:
+	struct Entry {
+		u32 offset;
+		u32 size;
+		u64 version; // of the chunk's contents, kept by the world
+	};
+
+	static constexpr u32 headerSize = 16 + chunks * sizeof(Entry);
+
+	const std::string path;
+	mutable std::mutex writeMtx; // one writer (or compaction) at a time
+	mutable std::shared_timed_mutex sm; // for the fd and index
+	mutable int fd; // closed when there are too many files open, reopened when needed
+	std::vector<Entry> index; // empty if the file doesn't exist
+	std::map<u32, u32> freeSpace; // offset -> size, only used by writers
+	u32 fileEnd;
+	u32 usedBytes;
+	u32 storedChunks;
+	mutable std::mutex pinMtx; // for the members below
+	u32 generation; // changes when the file is replaced
+	mutable std::map<u32, u32> pins; // offset -> views of it
+	std::vector<Entry> deferredFrees; // released while pinned
+
+public:
+	// for the world's list of regions with open files
+	std::list<RegionFile *>::iterator openPos;
+	bool inOpenList;
+
+	RegionFile(std::string path);
+	~RegionFile();
+
+	RegionFile(const RegionFile&) = delete;
+
+	static u32 indexOf(i32 chunkX, i32 chunkY);
+
+	bool has(u32 i) const;
+	// whether any chunk of the n * n square at index i is stored, with one lock
+	bool hasAnyIn(u32 i, u32 n) const;
+	// returns 0 if the chunk isn't stored here
+	u64 getVersion(u32 i) const;
+	// returns false if the chunk isn't stored here
+	bool read(u32 i, std::vector<u8>& out) const;
+	// returns an empty view if the chunk isn't stored here
+	View map(u32 i) const;
+	void write(u32 i, const u8 * data, sz_t size, u64 version);
+	void erase(u32 i);
+
+	bool shouldCompact() const;
+	void compact();
+
+	// returns false if the file was in use
+	bool tryCloseFile();
+
+private:
+	void loadIndex();
+	void openFile() const;
+	void createFile();
+	static void writeHeader(int fd, const std::vector<Entry>&, const std::string& path);
+	u32 allocate(u32 size);
+	void release(u32 offset, u32 size);
+	void releaseDeferred();
+	void unpin(u32 offset, u32 generation) const;
+	void acquireFd(std::shared_lock<std::shared_timed_mutex>&) const;
+	void writeEntry(u32 i);
+	void removeFile();
+};
@@ -147,7 +147,7 @@ bool Server::listenAndRun() {
 	saveTimer = tc.startTimer([this] {
 		kickInactivePlayers();
 		if (wm.saveAll()) {
-			std::cout << "Worlds saved." << std::endl;
+			std::cout << "Saving worlds in the background." << std::endl;
 		}
 		
 		return true;
@@ -232,6 +232,57 @@ void Server::registerNotifs() {
 }
 
 void Server::registerPackets() {
+	pr.on<AreaProtection>([] (Client& c, Chunk::ProtPos x, Chunk::ProtPos y, u16 w, u16 h, bool state) {
+		World& world = c.getPlayer().getWorld();
+		if (world.canManageProtections(c.getUser())) {
+			world.setAreaProtection(x, y, w, h, state);
+		}
+	});
+
+	pr.on<Viewport>([] (Client& c, Chunk::Pos x, Chunk::Pos y, u8 w, u8 h) {
+		Player& pl = c.getPlayer();
+		pl.getWorld().setViewport(pl, x, y, w, h);
+	});
+
+	pr.on<Paint>([] (Client& c, World::Pos x, World::Pos y, u8 r, u8 g, u8 b) {
+		RGB_u clr;
+		clr.r = r;
+		clr.g = g;
+		clr.b = b;
+		clr.a = 255;
+		c.getPlayer().tryPaint(x, y, clr);
+	});
+
+	pr.on<PaintLine>([] (Client& c, World::Pos x0, World::Pos y0, World::Pos x1, World::Pos y1, u8 r, u8 g, u8 b) {
+		RGB_u clr;
+		clr.r = r;
+		clr.g = g;
+		clr.b = b;
+		clr.a = 255;
+		c.getPlayer().tryPaintLine(x0, y0, x1, y1, clr);
+	});
+
+	pr.on<PaintRect>([] (Client& c, World::Pos x, World::Pos y, u16 w, u16 h, u8 r, u8 g, u8 b) {
+		RGB_u clr;
+		clr.r = r;
+		clr.g = g;
+		clr.b = b;
+		clr.a = 255;
+		c.getPlayer().tryPaintRect(x, y, w, h, clr);
+	});
+
+	pr.on<PaintBlit>([] (Client& c, World::Pos x, World::Pos y, u8 w, u8 h, std::vector<u8> mask, std::vector<u8> rgb) {
+		c.getPlayer().tryPaintBlit(x, y, w, h, mask, rgb);
+	});
+
+	pr.on<CursorMove>([] (Client& c, World::Pos x, World::Pos y, Player::Step step, Player::Tid tool) {
+		c.getPlayer().tryMoveTo(x, y, step, tool);
+	});
+
+	pr.on<Chat>([] (Client& c, std::string msg) {
+		c.getPlayer().tryChat(msg);
+	});
+
 	//pr.on<>
 }
 
@@ -241,6 +292,8 @@ void Server::unsafeStop() {
 		stopCaller = nullptr;
 		tc.clearTimers();
 		tb.prepareForDestruction();
+		// the writes that were queued or didn't get to finish
+		wm.saveAllNow();
 		ap.lazyDisconnect();
 	}
 }
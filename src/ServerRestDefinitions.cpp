@@ -6,6 +6,8 @@
 #include <User.hpp>
 #include <Player.hpp>
 #include <World.hpp>
+#include <Session.hpp>
+#include <HttpData.hpp>
 
 #include <shared_ptr_ll.hpp>
 #include <utils.hpp>
@@ -126,6 +128,97 @@ void Server::registerEndpoints() {
 		world.sendChunk(x, y, /*downscaling,*/ std::move(req));
 	});
 
+	api.on(ApiProcessor::MGET) // Downscaled view, for zoomed out clients
+		.path("worlds")
+		.var()
+		.path("tiles")
+		.var()
+		.var()
+		.var()
+	.end([this] (ll::shared_ptr<Request> req, std::string_view, std::string worldName, u8 downscaling, i32 x, i32 y) {
+		if (!wm.verifyWorldName(worldName) || downscaling > 16 || downscaling < 2
+				|| (downscaling & (downscaling - 1)) != 0) { // not power of 2
+			req->writeStatus("400 Bad Request");
+			req->end();
+			return;
+		}
+
+		if (!wm.isLoaded(worldName)) {
+			req->writeStatus("404 Not Found");
+			req->end();
+			return;
+		}
+
+		World& world = wm.getOrLoadWorld(worldName);
+
+		// x and y are in tiles of downscaling * downscaling chunks
+		world.sendTile(popc(downscaling - 1), x, y, std::move(req));
+	});
+
+	const auto protectArea = [this] (ll::shared_ptr<Request> req, const std::string& worldName,
+			Chunk::ProtPos x, Chunk::ProtPos y, u32 w, u32 h, bool state) {
+		if (!wm.verifyWorldName(worldName)) {
+			req->writeStatus("400 Bad Request");
+			req->end();
+			return;
+		}
+
+		if (!wm.isLoaded(worldName)) {
+			req->writeStatus("404 Not Found");
+			req->end();
+			return;
+		}
+
+		// only users connected to the server have a session here
+		auto token = req->getData().getCookie("uviastoken");
+		auto session = am.getSession(token ? *token : std::string_view());
+		if (!session) {
+			req->writeStatus("401 Unauthorized");
+			req->end();
+			return;
+		}
+
+		World& world = wm.getOrLoadWorld(worldName);
+		if (!world.canManageProtections(session->getUser())) {
+			req->writeStatus("403 Forbidden");
+			req->end();
+			return;
+		}
+
+		if (!world.setAreaProtection(x, y, w, h, state)) {
+			req->writeStatus("400 Bad Request");
+			req->end();
+			return;
+		}
+
+		req->writeStatus("204 No Content");
+		req->end();
+	};
+
+	api.on(ApiProcessor::MPUT) // Protect area, in 16x16 cells
+		.path("worlds")
+		.var()
+		.path("protections")
+		.var()
+		.var()
+		.var()
+		.var()
+	.end([protectArea] (ll::shared_ptr<Request> req, std::string_view, std::string worldName, Chunk::ProtPos x, Chunk::ProtPos y, u32 w, u32 h) {
+		protectArea(std::move(req), worldName, x, y, w, h, true);
+	});
+
+	api.on(ApiProcessor::MDELETE) // Unprotect area
+		.path("worlds")
+		.var()
+		.path("protections")
+		.var()
+		.var()
+		.var()
+		.var()
+	.end([protectArea] (ll::shared_ptr<Request> req, std::string_view, std::string worldName, Chunk::ProtPos x, Chunk::ProtPos y, u32 w, u32 h) {
+		protectArea(std::move(req), worldName, x, y, w, h, false);
+	});
+
 	api.on(ApiProcessor::MPOST) // Switch world
 		.path("worlds")
 		.var()
@@ -322,7 +415,8 @@ void Server::registerEndpoints() {
 			{ "uptime", std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - startupTime).count() }, // lol
 			{ "yourIp", ip },
 			{ "banned", banned },
-			{ "tps", wm.getTps() }
+			{ "tps", wm.getTps() },
+			{ "oldClusters", wm.getClusterConversionInfo() }
 		};
 
 		nlohmann::json processorInfo;
@@ -10,7 +10,14 @@
 #include <cstdlib>
 #include <array>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
 #include <Chunk.hpp>
+#include <config.hpp>
+#include <IncrementalPngEncoder.hpp>
 
 #include <PngImage.hpp>
 #include <rle.hpp>
@@ -30,25 +37,18 @@ static twoi32 mk_twoi32(i32 x, i32 y) {
 	return u;
 }
 
-WorldStorage::WorldStorage(std::string worldDir, std::string worldName)
-: PropertyReader(worldDir + "/props.txt"),
-  worldDir(std::move(worldDir)),
-  worldName(std::move(worldName)) {
-	if (!fileExists(this->worldDir) && !makeDir(this->worldDir)) {
-		throw std::runtime_error("Couldn't create world directory: " + this->worldDir);
-	}
-
-	loadProtectionData();
-	std::string pattern(this->worldDir + "/r.*.pxr");
+// finds the positions of the dir/r.X.Y.ext files
+static bool globChunkFiles(const std::string& dir, const std::string& ext, std::set<twoi32>& out) {
+	std::string pattern(dir + "/r.*." + ext);
 	glob_t result; // XXX: careful with exceptions here
 	if (int err = glob(pattern.c_str(), GLOB_NOSORT, nullptr, &result)) {
 		if (err != GLOB_NOMATCH) {
 			std::cerr << "glob() error: " << err << std::endl;
 		}
-		return;
+		return false;
 	}
 
-	sz_t s = this->worldDir.size() + 3;
+	sz_t s = dir.size() + 3;
 	for (sz_t i = 0; i < result.gl_pathc; i++) {
 		char * c = result.gl_pathv[i];
 		// we can assume that the string will be as long
@@ -57,12 +57,34 @@ WorldStorage::WorldStorage(std::string worldDir, std::string worldName)
 		twoi32 pos;
 		pos.x = std::strtol(c, &c, 10);
 		pos.y = std::strtol(c + 1, &c, 10);
-		remainingOldClusters.emplace(pos);
+		out.emplace(pos);
 	}
 
 	globfree(&result);
+	return true;
+}
+
+WorldStorage::WorldStorage(std::string worldDir, std::string worldName)
+: PropertyReader(worldDir + "/props.txt"),
+  worldDir(std::move(worldDir)),
+  worldName(std::move(worldName)),
+  convertedClusters(0),
+  solidChunkPngClr({.rgb = 0}) {
+	if (!fileExists(this->worldDir) && !makeDir(this->worldDir)) {
+		throw std::runtime_error("Couldn't create world directory: " + this->worldDir);
+	}
+
+	loadProtectionData();
 
-	std::cout << "World " << getWorldName() << " has " << remainingOldClusters.size() << " old clusters left" << std::endl;
+	globChunkFiles(this->worldDir, "region", regionFiles);
+	globChunkFiles(this->worldDir, "png", legacyChunks);
+	if (legacyChunks.size() != 0) {
+		std::cout << "World " << getWorldName() << " has " << legacyChunks.size() << " chunk files to move to regions" << std::endl;
+	}
+
+	if (globChunkFiles(this->worldDir, "pxr", remainingOldClusters)) {
+		std::cout << "World " << getWorldName() << " has " << remainingOldClusters.size() << " old clusters left" << std::endl;
+	}
 }
 
 WorldStorage::WorldStorage(std::tuple<std::string, std::string> args)
@@ -84,16 +106,239 @@ std::string WorldStorage::getChunkFilePath(i32 x, i32 y) const {
 	return worldDir + "/r." + std::to_string(x) + "." + std::to_string(y) + ".png";
 }
 
+std::string WorldStorage::getRegionFilePath(i32 rx, i32 ry) const {
+	return worldDir + "/r." + std::to_string(rx) + "." + std::to_string(ry) + ".region";
+}
+
 EChunkFormat WorldStorage::isChunkOnDisk(i32 x, i32 y) const {
 	// xxx: doesnt work right if chunk is less than 512x512
 	static_assert(Chunk::size == 512, "Chunk::size is not 512, this function won't work");
-	if (remainingOldClusters.find(mk_twoi32(x, y)) != remainingOldClusters.end()) {
+	if (!isClusterConverted(getClusterOf(x, y))) {
+		return C_PXR;
+	}
+
+	twoi32 pos = mk_twoi32(x >> RegionFile::shift, y >> RegionFile::shift);
+	RegionFile * r = nullptr;
+	{
+		std::lock_guard<std::mutex> _(regionsMtx);
+		auto search = regions.find(pos.pos);
+		if (search != regions.end()) {
+			r = search->second.get();
+		} else if (regionFiles.count(pos)) {
+			return C_UNKNOWN;
+		}
+	}
+
+	// the index is in memory, the file doesn't need to be open
+	if (r && r->has(RegionFile::indexOf(x, y))) {
+		return C_PNG;
+	}
+
+	std::lock_guard<std::mutex> _(regionsMtx);
+	return legacyChunks.count(mk_twoi32(x, y)) ? C_PNG : C_NONE;
+}
+
+// true if the set has a position in the n * n square. sets of twoi32 are
+// sorted by row, so it's one lookup per row
+static bool anyInArea(const std::set<twoi32>& s, i32 x, i32 y, u32 n) {
+	for (u32 j = 0; j < n; j++) {
+		auto it = s.lower_bound(mk_twoi32(x, y + j));
+		if (it != s.end() && it->y == i32(y + j) && u32(it->x) - u32(x) < n) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+EChunkFormat WorldStorage::isAreaOnDisk(i32 x, i32 y, u32 n) const {
+	static_assert(Chunk::size == 512, "Chunk::size is not 512, this function won't work");
+	if (anyInArea(remainingOldClusters, x, y, n) || anyInArea(convertingClusters, x, y, n)
+			|| anyInArea(failedClusters, x, y, n)) {
 		return C_PXR;
-	} else if (fileExists(worldDir + "/r." + std::to_string(x) + "." + std::to_string(y) + ".png")) {
+	}
+
+	twoi32 pos = mk_twoi32(x >> RegionFile::shift, y >> RegionFile::shift);
+	RegionFile * r = nullptr;
+	{
+		std::lock_guard<std::mutex> _(regionsMtx);
+		auto search = regions.find(pos.pos);
+		if (search != regions.end()) {
+			r = search->second.get();
+		} else if (regionFiles.count(pos)) {
+			return C_UNKNOWN;
+		}
+	}
+
+	if (r && r->hasAnyIn(RegionFile::indexOf(x, y), n)) {
 		return C_PNG;
 	}
 
-	return C_NONE;
+	std::lock_guard<std::mutex> _(regionsMtx);
+	return anyInArea(legacyChunks, x, y, n) ? C_PNG : C_NONE;
+}
+
+bool WorldStorage::isRegionOpen(i32 x, i32 y) const {
+	twoi32 pos = mk_twoi32(x >> RegionFile::shift, y >> RegionFile::shift);
+	std::lock_guard<std::mutex> _(regionsMtx);
+	return regions.count(pos.pos) || !regionFiles.count(pos);
+}
+
+void WorldStorage::openRegion(i32 x, i32 y) const {
+	getRegion(x, y, false);
+}
+
+bool WorldStorage::readChunk(i32 x, i32 y, std::vector<u8>& out, bool migrate) const {
+	RegionFile * r = getRegion(x, y, false);
+	if (r && r->read(RegionFile::indexOf(x, y), out)) {
+		return true;
+	}
+
+	{
+		std::lock_guard<std::mutex> _(regionsMtx);
+		if (!legacyChunks.count(mk_twoi32(x, y))) {
+			return false;
+		}
+	}
+
+	std::ifstream ch(getChunkFilePath(x, y), std::ios::binary | std::ios::ate);
+	if (!ch) {
+		return false;
+	}
+
+	sz_t size = ch.tellg();
+	ch.seekg(0);
+	out.resize(size);
+	ch.read(reinterpret_cast<char *>(out.data()), size);
+	ch.close();
+
+	if (migrate && size != 0) {
+		writeChunk(x, y, out.data(), out.size(), 0);
+	}
+
+	return true;
+}
+
+// old chunk files are only mapped after moving them to the region
+RegionFile::View WorldStorage::mapChunk(i32 x, i32 y, bool migrate) const {
+	RegionFile * r = getRegion(x, y, false);
+	if (r) {
+		if (auto v = r->map(RegionFile::indexOf(x, y))) {
+			return v;
+		}
+	}
+
+	std::vector<u8> legacy;
+	if (migrate && readChunk(x, y, legacy, true)) {
+		// empty legacy files are read but not moved to a region
+		if (RegionFile * nr = getRegion(x, y, false)) {
+			return nr->map(RegionFile::indexOf(x, y));
+		}
+	}
+
+	return RegionFile::View();
+}
+
+void WorldStorage::writeChunk(i32 x, i32 y, const u8 * data, sz_t size, u64 version) const {
+	RegionFile * r = getRegion(x, y, true);
+	r->write(RegionFile::indexOf(x, y), data, size, version);
+	removeLegacyChunk(x, y);
+
+	if (r->shouldCompact()) {
+		r->compact();
+	}
+}
+
+u64 WorldStorage::getChunkVersion(i32 x, i32 y) const {
+	RegionFile * r = getRegion(x, y, false);
+	return r ? r->getVersion(RegionFile::indexOf(x, y)) : 0;
+}
+
+void WorldStorage::deleteChunk(i32 x, i32 y) const {
+	if (RegionFile * r = getRegion(x, y, false)) {
+		r->erase(RegionFile::indexOf(x, y));
+	}
+
+	removeLegacyChunk(x, y);
+}
+
+// returns null if the region file doesn't exist and create is false.
+// regions stay in the map once used, their index tells which chunks exist
+RegionFile * WorldStorage::getRegion(i32 x, i32 y, bool create) const {
+	twoi32 pos = mk_twoi32(x >> RegionFile::shift, y >> RegionFile::shift);
+	std::unique_lock<std::mutex> lk(regionsMtx);
+	auto search = regions.find(pos.pos);
+	if (search == regions.end()) {
+		if (!create && regionFiles.find(pos) == regionFiles.end()) {
+			return nullptr;
+		}
+
+		// opening reads the index and can rewrite old files, lookups
+		// from the main thread shouldn't wait for that
+		lk.unlock();
+		std::lock_guard<std::mutex> o(openMtx);
+		lk.lock();
+		search = regions.find(pos.pos);
+		if (search == regions.end()) {
+			lk.unlock();
+			auto opened = std::make_unique<RegionFile>(getRegionFilePath(pos.x, pos.y));
+			lk.lock();
+			search = regions.emplace(pos.pos, std::move(opened)).first;
+		}
+	}
+
+	RegionFile& r = *search->second;
+	if (r.inOpenList) {
+		openRegions.splice(openRegions.begin(), openRegions, r.openPos);
+	} else {
+		openRegions.push_front(&r);
+		r.openPos = openRegions.begin();
+		r.inOpenList = true;
+	}
+
+	// close the least recently used files, files in use are skipped
+	for (auto it = std::prev(openRegions.end());
+			openRegions.size() > WORLD_MAX_FILE_HANDLES && it != openRegions.begin();) {
+		auto prev = std::prev(it);
+		RegionFile * old = *it;
+		if (old->tryCloseFile()) {
+			old->inOpenList = false;
+			openRegions.erase(it);
+		}
+
+		it = prev;
+	}
+
+	return &r;
+}
+
+void WorldStorage::removeLegacyChunk(i32 x, i32 y) const {
+	std::lock_guard<std::mutex> _(regionsMtx);
+	if (legacyChunks.erase(mk_twoi32(x, y)) != 0) {
+		std::string fpath(getChunkFilePath(x, y));
+		if (std::remove(fpath.c_str())) {
+			std::string s("Couldn't delete chunk file (" + fpath + ")");
+			std::perror(s.c_str());
+		}
+	}
+}
+
+const std::vector<u8>& WorldStorage::getSolidChunkPng() const {
+	RGB_u clr = getBackgroundColor();
+	if (solidChunkPng.empty() || solidChunkPngClr.rgb != clr.rgb) {
+		// one color palette, every index is 0
+		std::vector<u8> row(Chunk::size, 0);
+		IncrementalPngEncoder enc(Chunk::size, Chunk::size);
+		enc.encode(solidChunkPng, IncrementalPngEncoder::PALETTE, [&row] (u32) {
+			return row.data();
+		}, [clr] {
+			return std::vector<u8>{clr.r, clr.g, clr.b};
+		});
+
+		solidChunkPngClr = clr;
+	}
+
+	return solidChunkPng;
 }
 
 bool WorldStorage::save() {
@@ -118,6 +363,26 @@ u16 WorldStorage::getPixelRate() {
 	return 32;
 }
 
+sz_t WorldStorage::getMaxLoadedChunks() {
+	try {
+		return fromString<sz_t>(getProp("maxchunks", std::to_string(WORLD_MAX_CHUNKS_LOADED)));
+	} catch(const std::exception& e) {
+		std::cerr << "Invalid max loaded chunks specified in world cfg" << std::endl;
+	}
+
+	return WORLD_MAX_CHUNKS_LOADED;
+}
+
+u32 WorldStorage::getClusterConversionLimit() {
+	try {
+		return fromString<u32>(getProp("convertjobs", std::to_string(WORLD_MAX_CLUSTER_CONVERSIONS)));
+	} catch(const std::exception& e) {
+		std::cerr << "Invalid cluster conversion limit specified in world cfg" << std::endl;
+	}
+
+	return WORLD_MAX_CLUSTER_CONVERSIONS;
+}
+
 RGB_u WorldStorage::getBackgroundColor() const {
 	RGB_u clr = {.rgb = 0xFFFFFFFF};
 	if (hasProp("bgcolor")) try {
@@ -155,6 +420,14 @@ void WorldStorage::setPixelRate(u16 v) {
 	setProp("paintrate", std::to_string(v));
 }
 
+void WorldStorage::setMaxLoadedChunks(sz_t v) {
+	setProp("maxchunks", std::to_string(v));
+}
+
+void WorldStorage::setClusterConversionLimit(u32 v) {
+	setProp("convertjobs", std::to_string(v));
+}
+
 void WorldStorage::setBackgroundColor(RGB_u clr) {
 	setProp("bgcolor", std::string("0x") + n2hexstr(clr.rgb));
 }
@@ -167,51 +440,122 @@ void WorldStorage::setPassword(std::string s) {
 	setProp("password", std::move(s));
 }
 
-void WorldStorage::convertNext() {
-	if (remainingOldClusters.size() == 0) return;
-	twoi32 p = *remainingOldClusters.begin();
-	maybeConvert(p.x, p.y);
+twoi32 WorldStorage::getClusterOf(i32 chunkX, i32 chunkY) {
+	int times = 512 / Chunk::size; // assuming result is power of 2
+	return mk_twoi32(chunkX >> (times - 1), chunkY >> (times - 1));
 }
 
-void WorldStorage::maybeConvertChunk(Chunk::Pos x, Chunk::Pos y) {
-	int times = 512 / Chunk::size; // assuming result is power of 2
-	maybeConvert(x >> (times - 1), y >> (times - 1));
+bool WorldStorage::isClusterConverted(twoi32 pos) const {
+	return remainingOldClusters.find(pos) == remainingOldClusters.end()
+		&& convertingClusters.find(pos) == convertingClusters.end()
+		&& failedClusters.find(pos) == failedClusters.end();
+}
+
+bool WorldStorage::isClusterConverting(twoi32 pos) const {
+	return convertingClusters.find(pos) != convertingClusters.end();
 }
 
-void WorldStorage::maybeConvert(i32 x, i32 y) {
-	twoi32 pos;
-	pos.x = x;
-	pos.y = y;
+std::optional<twoi32> WorldStorage::getNextOldCluster() const {
+	if (remainingOldClusters.empty()) {
+		return std::nullopt;
+	}
+
+	return *remainingOldClusters.begin();
+}
 
+std::vector<twoi32> WorldStorage::beginClusterConversion(twoi32 pos) {
+	remainingOldClusters.erase(pos);
+	failedClusters.erase(pos);
+	convertingClusters.emplace(pos);
+
+	// the worker decides which protections belong to which chunk
+	std::vector<twoi32> protections;
+	auto search = findProtectedCluster(pos);
+	if (search != pclust.end()) {
+		auto first = pcells.begin() + search->offset;
+		protections.assign(first, first + search->size);
+		search->size = 0;
+	}
+
+	return protections;
+}
+
+void WorldStorage::endClusterConversion(twoi32 pos, bool ok, std::vector<twoi32> leftProtections) {
+	convertingClusters.erase(pos);
+	if (ok) {
+		++convertedClusters;
+	} else {
+		// its chunks can't be loaded empty, they're still in the old file
+		failedClusters.emplace(pos);
+	}
+
+	// they came from this cluster's range, so they fit back in it
+	auto search = findProtectedCluster(pos);
+	if (search != pclust.end() && leftProtections.size() <= search->capacity) {
+		std::copy(leftProtections.begin(), leftProtections.end(), pcells.begin() + search->offset);
+		search->size = leftProtections.size();
+	}
+}
+
+sz_t WorldStorage::getRemainingClusterCount() const {
+	return remainingOldClusters.size() + convertingClusters.size() + failedClusters.size();
+}
+
+sz_t WorldStorage::getConvertedClusterCount() const {
+	return convertedClusters;
+}
+
+// thread safe, the chunks are written to their regions. protections that
+// were applied to a chunk are removed from the vector
+void WorldStorage::convertCluster(twoi32 pos, std::vector<twoi32>& protections, RGB_u bg) const {
 	if (Chunk::size > 512) {
 		throw std::logic_error("can't convert chunks bigger than 512x512");
 	}
 
-	if (remainingOldClusters.erase(pos) == 0) {
-		return;
-	}
 	// 512 = old region file dimensions
 	int times = 512 / Chunk::size;
 	std::unique_ptr<u8[]> buf;
+	std::string name(worldDir + "/r." + std::to_string(pos.x) + "." + std::to_string(pos.y) + ".pxr");
 
 	{
-		std::string name(worldDir + "/r." + std::to_string(x) + "." + std::to_string(y) + ".pxr");
 		std::ifstream file(name, std::ios::binary | std::ios::ate);
+		if (!file) {
+			throw std::runtime_error("Couldn't open old cluster file " + name);
+		}
+
 		sz_t size = file.tellg();
 		file.seekg(0);
 		buf = std::make_unique<u8[]>(size);
 		file.read((char*)buf.get(), size);
 		file.close();
-		if (std::remove(name.c_str())) {
-			std::string e("Couldn't delete old cluster file " + name);
-			std::perror(e.c_str());
-		}
 	}
 
 	u8 * ptr = buf.get();
 	for (int i = 0; i < times; i++) {
 		for (int j = 0; j < times; j++) {
-			PngImage result(Chunk::size, Chunk::size, getBackgroundColor());
+			i32 chunkx = pos.x * times + j;
+			i32 chunky = pos.y * times + i;
+
+			// the protections of this chunk are moved to the end
+			auto own = std::stable_partition(protections.begin(), protections.end(), [chunkx, chunky] (twoi32 p) {
+				return p.x >> Chunk::pcShift != chunkx || p.y >> Chunk::pcShift != chunky;
+			});
+
+			// written by an earlier attempt, or drawn on since. either way it's
+			// newer than the old cluster
+			RegionFile * r = getRegion(chunkx, chunky, false);
+			bool stored = r && r->has(RegionFile::indexOf(chunkx, chunky));
+			if (!stored) {
+				std::lock_guard<std::mutex> _(regionsMtx);
+				stored = legacyChunks.count(mk_twoi32(chunkx, chunky)) != 0;
+			}
+
+			if (stored) {
+				protections.erase(own, protections.end());
+				continue;
+			}
+
+			PngImage result(Chunk::size, Chunk::size, bg);
 
 			u32 offx = j * (32 / times);
 			u32 offy = i * (32 / times);
@@ -237,66 +581,56 @@ void WorldStorage::maybeConvert(i32 x, i32 y) {
 				return px;
 			});
 
-			i32 chunkx = x * times + j;
-			i32 chunky = y * times + i;
-
-			std::string path(getChunkFilePath(chunkx, chunky));
-			auto search = pclust.find(pos.pos);
-			if (search != pclust.end()) {
-				std::array<u32, Chunk::pc * Chunk::pc> prtect;
-				prtect.fill(0);
-				std::vector<twoi32>& dat = search->second;
-
-				dat.erase(std::remove_if(dat.begin(), dat.end(), [&prtect, chunkx, chunky] (twoi32 p) {
-					if (Chunk::protectionAreaSize > 16) {
-						throw std::logic_error("can't convert to bigger protection area sizes");
-					}
-
-					// this chunkx
-					i32 tcx = p.x >> Chunk::pcShift;
-					i32 tcy = p.y >> Chunk::pcShift;
-					if (!(tcx == chunkx && tcy == chunky)) {
-						return false;
-					}
+			std::array<u32, Chunk::pc * Chunk::pc> prtect;
+			prtect.fill(0);
+			const bool hasProtections = own != protections.end();
 
-					u16 pTimes = 16 / Chunk::protectionAreaSize;
+			for (auto it = own; it != protections.end(); ++it) {
+				if (Chunk::protectionAreaSize > 16) {
+					throw std::logic_error("can't convert to bigger protection area sizes");
+				}
 
+				u16 pTimes = 16 / Chunk::protectionAreaSize;
 
-					u16 x = p.x * pTimes & (Chunk::pc - 1);
-					u16 y = p.y * pTimes & (Chunk::pc - 1);
+				u16 x = it->x * pTimes & (Chunk::pc - 1);
+				u16 y = it->y * pTimes & (Chunk::pc - 1);
 
-					for (int k = 0; k < pTimes; k++) {
-						for (int l = 0; l < pTimes; l++) {
-							prtect[(y + k) * Chunk::pc + (x + l)] = 1;
-						}
+				for (int k = 0; k < pTimes; k++) {
+					for (int l = 0; l < pTimes; l++) {
+						prtect[(y + k) * Chunk::pc + (x + l)] = 1;
 					}
-
-					return true;
-				}), dat.end());
-
-				if (dat.size() == 0) {
-					pclust.erase(search);
 				}
+			}
 
+			if (hasProtections) {
 				result.setChunkWriter("woPp", [&prtect] {
 					return rle::compress(prtect.data(), prtect.size());
 				});
-				result.writeFile(path); // scoped array, can't fall through
-				continue;
 			}
-			result.writeFile(path);
+
+			std::vector<u8> png;
+			result.writeFileOnMem(png);
+			writeChunk(chunkx, chunky, png.data(), png.size(), 0);
+			// only dropped once they're in the chunk, a failed write gives them back
+			protections.erase(own, protections.end());
 		}
 	}
+
+	// only removed once every chunk is safe in its region
+	if (std::remove(name.c_str())) {
+		std::string e("Couldn't delete old cluster file " + name);
+		std::perror(e.c_str());
+	}
 }
 
 void WorldStorage::saveProtectionData() {
 	std::string name(worldDir + "/pchunks.bin");
-	std::vector<twoi32> data;
-	for (auto& v : pclust) {
-		data.insert(data.end(), v.second.begin(), v.second.end());
+	sz_t cells = 0;
+	for (const auto& c : pclust) {
+		cells += c.size;
 	}
 
-	if (data.size() == 0) {
+	if (cells == 0) {
 		if (fileExists(name)) {
 			std::remove(name.c_str());
 		}
@@ -308,43 +642,112 @@ void WorldStorage::saveProtectionData() {
 		throw std::runtime_error("Couldn't open file " + name);
 	}
 
-	file.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(twoi32));
+	for (const auto& c : pclust) {
+		file.write(reinterpret_cast<const char*>(pcells.data() + c.offset), c.size * sizeof(twoi32));
+	}
+}
+
+// the position of the old cluster of a protected cell
+static u64 clusterKey(twoi32 cell) {
+	return mk_twoi32(cell.x >> 5, cell.y >> 5).pos;
 }
 
 void WorldStorage::loadProtectionData() {
 	std::string name(worldDir + "/pchunks.bin");
-	std::ifstream file(name, std::ios::binary | std::ios::ate);
-	if (file) {
-		const sz_t size = file.tellg();
-		if (size % 8) { // not multiple of 8?
-			std::cerr << "Protection file corrupted, at: "
-				<< worldDir << ", ignoring." << std::endl;
-		} else {
-			const sz_t itemsonfile = size / 8;
-			std::cout << "Sorting protected chunk data (" << itemsonfile << " prot. chunks left, world: "<< getWorldName() << ")" << std::endl;
-			auto rankedarr(std::make_unique<u64[]>(itemsonfile));
-			file.seekg(0);
-			file.read((char*)rankedarr.get(), size);
-
-			for (sz_t i = 0; i < itemsonfile;) {
-				twoi32 s, c;
-				s.pos = rankedarr[i];
-				c.x = s.x >> 5;
-				c.y = s.y >> 5;
-				auto sr = pclust.find(c.pos);
-				if (sr == pclust.end()) {
-					pclust.emplace(std::make_pair(c.pos, std::vector<twoi32>{s}));
-				} else {
-					sr->second.push_back(s);
-				}
+	int fd = open(name.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
 
-				i++;
-				if (!(i % 65536) || i == itemsonfile) {
-					std::cout << "Sort progress: " << i << "/" << itemsonfile << " (" << (i * 100 / itemsonfile) << "%)" << std::endl;
-				}
-			}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return;
+	}
+
+	const sz_t size = st.st_size;
+	if (size % sizeof(twoi32)) { // not multiple of 8?
+		std::cerr << "Protection file corrupted, at: "
+			<< worldDir << ", ignoring." << std::endl;
+		close(fd);
+		return;
+	}
+
+	void * mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		throw std::runtime_error("Couldn't map file " + name);
+	}
+
+	madvise(mapping, size, MADV_SEQUENTIAL);
+
+	// lsd radix sort by cluster, 16 bits per pass. all the histograms are
+	// made in the first read, and passes where every cell has the same digit are skipped
+	const sz_t n = size / sizeof(twoi32);
+	const twoi32 * cells = static_cast<const twoi32 *>(mapping);
+	std::vector<sz_t> counts(4 << 16);
+	for (sz_t i = 0; i < n; i++) {
+		u64 k = clusterKey(cells[i]);
+		for (u32 d = 0; d < 4; d++) {
+			++counts[d << 16 | (k >> d * 16 & 0xFFFF)];
 		}
 	}
+
+	pcells.resize(n);
+	std::vector<twoi32> tmp(n);
+	const twoi32 * src = cells;
+	twoi32 * dst = tmp.data();
+	for (u32 d = 0; d < 4; d++) {
+		sz_t * offsets = &counts[d << 16];
+		if (offsets[clusterKey(src[0]) >> d * 16 & 0xFFFF] == n) {
+			continue;
+		}
+
+		sz_t sum = 0;
+		for (u32 i = 0; i < 1 << 16; i++) {
+			sz_t c = offsets[i];
+			offsets[i] = sum;
+			sum += c;
+		}
+
+		for (sz_t i = 0; i < n; i++) {
+			dst[offsets[clusterKey(src[i]) >> d * 16 & 0xFFFF]++] = src[i];
+		}
+
+		src = dst;
+		dst = dst == tmp.data() ? pcells.data() : tmp.data();
+	}
+
+	if (src == cells) {
+		// all in one cluster
+		std::copy(cells, cells + n, pcells.begin());
+	} else if (src == tmp.data()) {
+		pcells.swap(tmp);
+	}
+
+	munmap(mapping, size);
+
+	for (sz_t i = 0; i < n;) {
+		u64 k = clusterKey(pcells[i]);
+		sz_t first = i;
+		while (i < n && clusterKey(pcells[i]) == k) {
+			i++;
+		}
+
+		u32 count = i - first;
+		pclust.push_back({k, static_cast<u32>(first), count, count});
+	}
+
+	std::cout << "Loaded " << n << " protected cells in " << pclust.size()
+		<< " old clusters (world: " << getWorldName() << ")" << std::endl;
+}
+
+std::vector<WorldStorage::ProtectedCluster>::iterator WorldStorage::findProtectedCluster(twoi32 pos) {
+	auto it = std::lower_bound(pclust.begin(), pclust.end(), pos.pos, [] (const ProtectedCluster& c, u64 p) {
+		return c.pos < p;
+	});
+
+	return it != pclust.end() && it->pos == pos.pos ? it : pclust.end();
 }
 
 Storage::Storage(std::string bPath)
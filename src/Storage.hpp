@@ -7,8 +7,13 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <list>
+#include <optional>
+#include <mutex>
+#include <memory>
 
 #include <BansManager.hpp>
+#include <RegionFile.hpp>
 
 #include <explints.hpp>
 #include <PropertyReader.hpp>
@@ -30,15 +35,45 @@ bool operator<(const twoi32& a, const twoi32& b);
 enum EChunkFormat {
 	C_NONE = 0,
 	C_PXR,
-	C_PNG
+	C_PNG,
+	C_UNKNOWN // the region file has to be opened first, see openRegion()
 };
 
 class WorldStorage : PropertyReader {
 	const std::string worldDir; // path for the world files
 	const std::string worldName;
 
-	std::map<u64, std::vector<twoi32>> pclust;
+	struct ProtectedCluster {
+		u64 pos;
+		u32 offset; // in pcells
+		u32 capacity;
+		u32 size; // 0 once converted
+	};
+
+	// protected cells of the old clusters, grouped by cluster.
+	// pclust is sorted by position and points to the range of each
+	std::vector<twoi32> pcells;
+	std::vector<ProtectedCluster> pclust;
 	std::set<twoi32> remainingOldClusters;
+	std::set<twoi32> convertingClusters; // being converted by a worker
+	// couldn't be converted, tried again only when their chunks are needed
+	std::set<twoi32> failedClusters;
+	sz_t convertedClusters;
+
+	// chunks are stored in region files, they can be accessed from worker threads.
+	// files are opened one at a time, without holding regionsMtx
+	mutable std::mutex regionsMtx;
+	mutable std::mutex openMtx;
+	mutable std::map<u64, std::unique_ptr<RegionFile>> regions;
+	// region files found when the world was opened, the others don't exist
+	// unless they're in the regions map, so missing chunks are known without stat()
+	std::set<twoi32> regionFiles;
+	mutable std::list<RegionFile *> openRegions; // most recently used first
+	mutable std::set<twoi32> legacyChunks; // r.X.Y.png files not moved to a region yet
+
+	// png of a chunk filled with the background color, served for solid chunks
+	mutable std::vector<u8> solidChunkPng;
+	mutable RGB_u solidChunkPngClr;
 
 	// worldDir = directory of this world's data
 	WorldStorage(std::string worldDir, std::string worldName);
@@ -54,7 +89,24 @@ public:
 	const std::string& getWorldName() const;
 	const std::string& getWorldDir() const;
 	std::string getChunkFilePath(i32 x, i32 y) const;
+	std::string getRegionFilePath(i32 rx, i32 ry) const;
+	// only looks at the open regions, doesn't block on the disk
 	EChunkFormat isChunkOnDisk(i32 x, i32 y) const;
+	// same for a square of n * n chunks, which must not cross a region
+	EChunkFormat isAreaOnDisk(i32 x, i32 y, u32 n) const;
+	// false if the chunk's region file exists but hasn't been opened yet
+	bool isRegionOpen(i32 x, i32 y) const;
+	// reads the index of the chunk's region file and upgrades old files, for workers
+	void openRegion(i32 x, i32 y) const;
+
+	// thread safe. if migrate is set, old chunk files are moved to their region
+	bool readChunk(i32 x, i32 y, std::vector<u8>& out, bool migrate = false) const;
+	RegionFile::View mapChunk(i32 x, i32 y, bool migrate = false) const;
+	void writeChunk(i32 x, i32 y, const u8 * data, sz_t size, u64 version) const;
+	u64 getChunkVersion(i32 x, i32 y) const; // 0 if unknown
+	void deleteChunk(i32 x, i32 y) const;
+
+	const std::vector<u8>& getSolidChunkPng() const;
 
 	bool save();
 
@@ -62,21 +114,39 @@ public:
 	bool hasPassword();
 
 	u16 getPixelRate();
+	sz_t getMaxLoadedChunks();
+	u32 getClusterConversionLimit();
 	RGB_u getBackgroundColor() const;
 	std::string_view getMotd() const;
 	std::string_view getPassword();
 
 	void setPixelRate(u16);
+	void setMaxLoadedChunks(sz_t);
 	void setBackgroundColor(RGB_u);
 	void setMotd(std::string);
 	void setPassword(std::string);
+	void setClusterConversionLimit(u32);
+
+	// old .pxr clusters are converted by workers, the world tracks which are in progress
+	static twoi32 getClusterOf(i32 chunkX, i32 chunkY);
+	bool isClusterConverted(twoi32) const;
+	bool isClusterConverting(twoi32) const;
+	std::optional<twoi32> getNextOldCluster() const;
+	// returns the protection data of the cluster, for convertCluster()
+	std::vector<twoi32> beginClusterConversion(twoi32);
+	void convertCluster(twoi32, std::vector<twoi32>& protections, RGB_u bg) const;
+	void endClusterConversion(twoi32, bool ok, std::vector<twoi32> leftProtections);
+	sz_t getRemainingClusterCount() const;
+	sz_t getConvertedClusterCount() const;
 
-	void convertNext();
-	void maybeConvertChunk(i32, i32);
-	void maybeConvert(i32, i32);
 	void loadProtectionData();
 	void saveProtectionData();
 
+private:
+	std::vector<ProtectedCluster>::iterator findProtectedCluster(twoi32);
+	RegionFile * getRegion(i32 x, i32 y, bool create) const;
+	void removeLegacyChunk(i32 x, i32 y) const;
+
 	friend World;
 };
 
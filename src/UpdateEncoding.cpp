@@ -0,0 +1,91 @@
+#include "UpdateEncoding.hpp"
+
+#include <algorithm>
+
+#include <Chunk.hpp>
+
+static void writeVarint(std::vector<u8>& out, u64 n) {
+	while (n >= 0x80) {
+		out.emplace_back(u8(n) | 0x80);
+		n >>= 7;
+	}
+
+	out.emplace_back(u8(n));
+}
+
+static void writeSigned(std::vector<u8>& out, i64 n) {
+	writeVarint(out, (u64(n) << 1) ^ u64(n >> 63));
+}
+
+void net::writeCursor(std::vector<u8>& out, const Cursor& c, std::optional<std::pair<World::Pos, World::Pos>> lastSent) {
+	auto [id, x, y, step, tool] = c;
+	writeVarint(out, u64(id) << 1 | bool(lastSent));
+	if (lastSent) {
+		writeSigned(out, i64(x) - lastSent->first);
+		writeSigned(out, i64(y) - lastSent->second);
+	} else {
+		writeSigned(out, x);
+		writeSigned(out, y);
+	}
+
+	out.emplace_back(step);
+	out.emplace_back(tool);
+}
+
+std::vector<u8> net::encodePixels(std::vector<Pixel>& pixels) {
+	constexpr u32 inChunk = Chunk::size - 1;
+	auto chunkOf = [] (const Pixel& p) {
+		return std::make_pair(std::get<1>(p) >> Chunk::posShift, std::get<0>(p) >> Chunk::posShift);
+	};
+
+	auto indexOf = [] (const Pixel& p) {
+		return (u32(std::get<1>(p)) & inChunk) << Chunk::posShift | (u32(std::get<0>(p)) & inChunk);
+	};
+
+	std::sort(pixels.begin(), pixels.end(), [&] (const Pixel& a, const Pixel& b) {
+		auto ca = chunkOf(a);
+		auto cb = chunkOf(b);
+		return ca < cb || (ca == cb && indexOf(a) < indexOf(b));
+	});
+
+	std::vector<u8> out;
+	out.reserve(pixels.size() * 2 + 16);
+
+	Chunk::Pos lastCx = 0;
+	Chunk::Pos lastCy = 0;
+	for (auto it = pixels.begin(); it != pixels.end();) {
+		const auto chunk = chunkOf(*it);
+		const Chunk::Pos cx = chunk.second;
+		const Chunk::Pos cy = chunk.first;
+		auto chunkEnd = std::find_if(it, pixels.end(), [&] (const Pixel& p) {
+			return chunkOf(p) != chunk;
+		});
+
+		writeSigned(out, i64(cx) - lastCx);
+		writeSigned(out, i64(cy) - lastCy);
+		writeVarint(out, chunkEnd - it);
+		lastCx = cx;
+		lastCy = cy;
+
+		u32 lastIndex = 0;
+		while (it != chunkEnd) {
+			auto runEnd = std::find_if(it, chunkEnd, [&] (const Pixel& p) {
+				return std::get<2>(p) != std::get<2>(*it)
+					|| std::get<3>(p) != std::get<3>(*it)
+					|| std::get<4>(p) != std::get<4>(*it);
+			});
+
+			writeVarint(out, runEnd - it);
+			out.emplace_back(std::get<2>(*it));
+			out.emplace_back(std::get<3>(*it));
+			out.emplace_back(std::get<4>(*it));
+			for (; it != runEnd; ++it) {
+				u32 idx = indexOf(*it);
+				writeVarint(out, idx - lastIndex);
+				lastIndex = idx;
+			}
+		}
+	}
+
+	return out;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <vector>
+#include <optional>
+#include <utility>
+
+#include <explints.hpp>
+#include <PacketDefinitions.hpp>
+
+// compact cursor and pixel lists of the WorldUpdate packet. integers are LEB128
+// varints, signed ones are zigzag encoded first. lists are read until their end
+namespace net {
+
+// one cursor, relative to the position the clients got last if there's one:
+//  varint (id << 1 | relative), signed x, signed y, u8 step, u8 tool
+void writeCursor(std::vector<u8>& out, const Cursor&, std::optional<std::pair<World::Pos, World::Pos>> lastSent);
+
+// sorts the pixels by chunk and position, there must be one per position:
+//  per chunk: signed x and y from the previous chunk, varint pixel count, then runs
+//  of one color: varint length, u8 r, g, b, and a varint position delta per pixel
+//  (y * Chunk::size + x inside the chunk, from the previous pixel of the chunk)
+std::vector<u8> encodePixels(std::vector<Pixel>&);
+
+} // namespace net
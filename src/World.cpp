@@ -6,14 +6,19 @@
 #include <config.hpp>
 #include <PacketDefinitions.hpp>
 #include <ApiProcessor.hpp>
+#include <ChunkResponseCache.hpp>
+#include <UpdateEncoding.hpp>
+#include <PngDecoder.hpp>
+#include <IncrementalPngEncoder.hpp>
 
 #include <TaskBuffer.hpp>
+#include <PngImage.hpp>
 #include <utils.hpp>
 
 #include <iostream>
 #include <utility>
 #include <algorithm>
-#include <fstream>
+#include <cstring>
 
 #include <uWS.h>
 #include <nlohmann/json.hpp>
@@ -40,6 +45,89 @@ u64 key(i32 x, i32 y) {
 	return s.pos;
 }
 
+std::string etagOf(u64 version) {
+	return "\"" + n2hexstr(version) + "\"";
+}
+
+// ends the request with 304 if the client's copy is of this version.
+// version 0 means unknown (chunks not saved with one yet)
+bool sendNotModified(Request& req, u64 version) {
+	if (version == 0) {
+		return false;
+	}
+
+	auto inm = req.getHeader("if-none-match");
+	if (!inm || *inm != etagOf(version)) {
+		return false;
+	}
+
+	req.writeStatus("304 Not Modified");
+	req.writeHeader("ETag", etagOf(version));
+	req.writeHeader("Cache-Control", "no-cache");
+	req.end();
+	return true;
+}
+
+// clients must revalidate, usually getting a 304
+void writeCacheHeaders(Request& req, u64 version) {
+	if (version != 0) {
+		req.writeHeader("ETag", etagOf(version));
+		req.writeHeader("Cache-Control", "no-cache");
+	}
+}
+
+// writes a chunk or tile png scaled down to half its size, as RGB rows of stride bytes
+void downscalePng(u8 * data, sz_t size, RGB_u bg, u8 * out, sz_t stride) {
+	auto rows(std::make_unique<u8[]>(Chunk::size * 3 * 2));
+	u8 * a = rows.get();
+	u8 * b = a + Chunk::size * 3;
+	// smaller images are padded with the background color
+	for (u32 i = 0; i < Chunk::size * 2; i++) {
+		a[i * 3] = bg.r;
+		a[i * 3 + 1] = bg.g;
+		a[i * 3 + 2] = bg.b;
+	}
+
+	PngDecoder dec;
+	std::unique_ptr<u8[]> rgbRow;
+	bool decoded = dec.decode(data, size, [&dec, &rgbRow, a, b, out, stride] (u32 y, const u8 * row) {
+		if (y >= Chunk::size) {
+			return;
+		}
+
+		if (!rgbRow) {
+			rgbRow = std::make_unique<u8[]>(dec.getWidth() * 3);
+		}
+
+		dec.rowToRgb(row, rgbRow.get());
+		std::memcpy(y & 1 ? b : a, rgbRow.get(), std::min<u32>(dec.getWidth(), Chunk::size) * 3);
+		if (y & 1) {
+			Chunk::halveRows(a, b, out + y / 2 * stride);
+		}
+	});
+
+	if (!decoded) {
+		// uncommon format, let PngImage deal with it
+		PngImage img;
+		img.readFileOnMem(data, size);
+		const u32 w = std::min<u32>(img.getWidth(), Chunk::size);
+		const u32 h = std::min<u32>(img.getHeight(), Chunk::size);
+		for (u32 y = 0; y < h; y++) {
+			u8 * dst = y & 1 ? b : a;
+			for (u32 x = 0; x < w; x++) {
+				RGB_u c = img.getPixel(x, y);
+				dst[x * 3] = c.r;
+				dst[x * 3 + 1] = c.g;
+				dst[x * 3 + 2] = c.b;
+			}
+
+			if (y & 1) {
+				Chunk::halveRows(a, b, out + y / 2 * stride);
+			}
+		}
+	}
+}
+
 void to_json(nlohmann::json& j, const World& w) {
 	auto owner(w.getOwner());
 	j = {
@@ -51,13 +139,23 @@ void to_json(nlohmann::json& j, const World& w) {
 
 /* World class functions */
 
-World::World(std::tuple<std::string, std::string> wsArgs, TaskBuffer& tb)
+World::World(std::tuple<std::string, std::string> wsArgs, TaskBuffer& tb, ChunkResponseCache& chunkResponses)
 : WorldStorage(std::move(wsArgs)),
   tb(tb),
+  chunkResponses(chunkResponses),
   updateRequired(false),
-  drawRestricted(false) { }
+  drawRestricted(false),
+  lruHead(nullptr),
+  lruTail(nullptr),
+  maxLoadedChunks(getMaxLoadedChunks()),
+  savesInFlight(0),
+  // like chunk versions, so that the etags don't repeat after a restart
+  nextTileVersion(std::chrono::duration_cast<std::chrono::microseconds>(
+	std::chrono::system_clock::now().time_since_epoch()).count()),
+  tileBuildsInFlight(0) { }
 
 World::~World() {
+	chunkResponses.eraseAll(this);
 	std::cout << "World unloaded: " << getWorldName() << std::endl;
 }
 
@@ -65,32 +163,53 @@ void World::setUnloadFunc(std::function<void()> unloadFunc) {
 	unload = std::move(unloadFunc);
 }
 
-sz_t World::unloadOldChunks(bool force) { // TODO: handle force flag better
+sz_t World::unloadOldChunks(bool force) {
 	sz_t unloadCount = 0;
+	forgetEvictedTiles();
+
+	// from the oldest to the newest
+	for (Chunk * c = lruTail; c != nullptr;) {
+		Chunk * next = c->lruPrev;
+		if (c->shouldUnload(force)) {
+			unloadCount += unloadChunk(*c);
+		} else if (c->shouldUnload(true)) {
+			// too new to unload, the rest of the list is newer
+			break;
+		}
 
-	//auto oldest = chunks.end();
+		c = next;
+	}
 
-	for (auto it = chunks.begin(); it != chunks.end();) {
-		if (it->second.shouldUnload(force)) {
-			/*if (force && (oldest == chunks.end() || it->second.getLastActionTime() < oldest->second.getLastActionTime())) {
-				oldest = it;
-			} else {*/
-				it = chunks.erase(it);
-				++unloadCount;
-			//}
-		} else {
-			++it;
+	return unloadCount;
+}
+
+sz_t World::unloadColdestChunks(sz_t count) {
+	sz_t unloadCount = 0;
+
+	for (Chunk * c = lruTail; c != nullptr && unloadCount < count;) {
+		Chunk * next = c->lruPrev;
+		if (c->shouldUnload(true)) {
+			unloadCount += unloadChunk(*c);
 		}
+
+		c = next;
 	}
-/*
-	if (oldest != chunks.end()) {
-		chunks.erase(oldest);
-		return 1;
-	}
-*/
+
 	return unloadCount;
 }
 
+sz_t World::getLoadedChunkCount() const {
+	return chunks.size();
+}
+
+std::optional<std::chrono::steady_clock::time_point> World::getColdestChunkTime() const {
+	if (!lruTail) {
+		return std::nullopt;
+	}
+
+	return lruTail->getLastActionTime();
+}
+
 void World::configurePlayerBuilder(Player::Builder& pb) {
 	pb.setWorld(*this)
 	  .setSpawnPoint(0, 0)
@@ -110,32 +229,74 @@ void World::playerJoined(Player& pl) {
 	}*/
 
 	players.emplace(std::ref(pl));
-	playerUpdated(pl);
 	WorldData::one(pl.getClient().getWs(), worldName, std::string(getMotd()), getBackgroundColor().rgb, drawRestricted, getOwner());
+
+	// until the client tells us what it sees
+	const Chunk::Pos half = WORLD_DEFAULT_VIEWPORT_CHUNKS / 2;
+	setViewport(pl, (pl.getX() >> Chunk::posShift) - half, (pl.getY() >> Chunk::posShift) - half,
+		WORLD_DEFAULT_VIEWPORT_CHUNKS, WORLD_DEFAULT_VIEWPORT_CHUNKS);
+	playerUpdated(pl);
 }
 
 void World::playerUpdated(Player& pl) {
-	playerUpdates.emplace(std::ref(pl));
+	if (queuedPlayerUpdates.emplace(&pl).second) {
+		playerUpdates.emplace_back(&pl);
+	}
+
 	schedUpdates();
 }
 
 void World::playerLeft(Player& pl) {
-	// XXX: a client could immediately join with the same pid
-	// solution: move player lefts at the beginning of the network update packet
-	playersLeft.emplace(pl.getPid());
+	playersLeft.emplace_back(pl.getPid());
 	ids.freeId(pl.getPid());
 	players.erase(std::ref(pl));
-	playerUpdates.erase(std::ref(pl));
+	if (queuedPlayerUpdates.erase(&pl)) {
+		playerUpdates.erase(std::find(playerUpdates.begin(), playerUpdates.end(), &pl));
+	}
+
+	interest.remove(pl);
+	laggingPlayers.erase(&pl);
 	schedUpdates();
 	if (players.size() == 0) {
 		tryUnloadWorld();
 	}
 }
 
+void World::setViewport(Player& pl, Chunk::Pos x, Chunk::Pos y, u32 w, u32 h) {
+	w = std::clamp<u32>(w, 1, WORLD_MAX_VIEWPORT_CHUNKS);
+	h = std::clamp<u32>(h, 1, WORLD_MAX_VIEWPORT_CHUNKS);
+	x = std::clamp<Chunk::Pos>(x, -border, border);
+	y = std::clamp<Chunk::Pos>(y, -border, border);
+
+	// the cursors already in the new cells, they're only sent when they move
+	sendCursorsIn(pl, interest.setView(pl, x, y, w, h));
+}
+
+// at the position sent to the others, the next moves are relative to it
+void World::sendCursorsIn(Player& pl, const std::vector<u64>& cells) {
+	std::vector<u8> cursors;
+	for (u64 cell : cells) {
+		if (auto * cs = interest.getCursors(cell)) {
+			for (Player * other : *cs) {
+				auto pos = interest.getSentCursorPos(*other);
+				if (other != &pl && pos) {
+					net::writeCursor(cursors, {other->getPid(), pos->first, pos->second, other->getStep(), other->getToolId()}, std::nullopt);
+				}
+			}
+		}
+	}
+
+	if (!cursors.empty()) {
+		WorldUpdate::one(pl.getClient().getWs(), std::vector<Player::Id>(), std::move(cursors), std::vector<u8>());
+	}
+}
+
 void World::schedUpdates() {
 	updateRequired = true;
 }
 
+// the updates of each grid cell are prepared once and sent to the players that see it.
+// what doesn't fit in the limits is sent on the next tick, oldest first
 void World::sendUpdates() {
 	if (!updateRequired) {
 		return;
@@ -143,89 +304,112 @@ void World::sendUpdates() {
 
 	updateRequired = false;
 
-	/*sz_t offs = 2;
-	u32 tmp;
-
-	u8 buf[1 + 1 + playerUpdates.size() * (sizeof(u32) + sizeof(pinfo_t))
-		+ sizeof(u16) + pixelUpdates.size() * sizeof(pixupd_t)
-		+ 1 + sizeof(u32) * playersLeft.size()];
-	u8 * const upd = &buf[0];
+	if (players.empty()) {
+		playerUpdates.clear();
+		queuedPlayerUpdates.clear();
+		pixelUpdates.clear();
+		pixelUpdateIndex.clear();
+		playersLeft.clear();
+		return;
+	}
 
-	upd[0] = UPDATE;
+	// before the updates of this tick, which are relative to the last cursor positions
+	resyncLaggingPlayers();
 
-	bool pendingUpdates = false;
+	bool pendingUpdates = !laggingPlayers.empty();
 
-	tmp = 0;
-	for (auto it = playerUpdates.begin();;) {
-		if (it == playerUpdates.end()) {
-			playerUpdates.clear();
-			break;
+	// to everyone, ids are reused and any client could have seen the cursor
+	if (!playersLeft.empty()) {
+		std::vector<Player::Id> left;
+		left.reserve(std::min<sz_t>(playersLeft.size(), WORLD_MAX_PLAYER_LEFT_UPDATES));
+		while (!playersLeft.empty() && left.size() < WORLD_MAX_PLAYER_LEFT_UPDATES) {
+			left.emplace_back(playersLeft.front());
+			playersLeft.pop_front();
 		}
-		if(tmp >= WORLD_MAX_PLAYER_UPDATES){
-			playerUpdates.erase(playerUpdates.begin(), it);
-			pendingUpdates = true;
-			break;
+
+		pendingUpdates |= !playersLeft.empty();
+		broadcast(WorldUpdate(std::move(left), std::vector<u8>(), std::vector<u8>()));
+	}
+
+	// cell -> encoded cursors and pixels, only for cells someone is looking at
+	std::unordered_map<u64, std::pair<std::vector<u8>, std::vector<net::Pixel>>> cells;
+
+	for (sz_t cursorCount = 0; !playerUpdates.empty() && cursorCount < WORLD_MAX_PLAYER_UPDATES; cursorCount++) {
+		Player& pl = *playerUpdates.front();
+		playerUpdates.pop_front();
+		queuedPlayerUpdates.erase(&pl);
+		net::Cursor cur(pl.getPid(), pl.getX(), pl.getY(), pl.getStep(), pl.getToolId());
+		auto mv = interest.moveCursor(pl, pl.getX(), pl.getY());
+
+		// the players that saw it before it moved to another cell see it leave.
+		// a cell's viewers might not have the last position if it just came in
+		if (mv.leftCell && interest.getViewers(*mv.leftCell)) {
+			net::writeCursor(cells[*mv.leftCell].first, cur, std::nullopt);
 		}
-		Player& pl = *it;
-		u32 id = pl.getPid();
-		i32 x = pl.getX();
-		i32 y = pl.getY();
-		memcpy((void *)(upd + offs), (void *)&id, sizeof(u32));
-		offs += sizeof(u32);
-		memcpy((void *)(upd + offs), (void *)&x, sizeof(i32));
-		offs += sizeof(i32);
-		memcpy((void *)(upd + offs), (void *)&y, sizeof(i32));
-		offs += sizeof(i32);
-		++it;
-		++tmp;
-	}
-	upd[1] = tmp;
-	tmp = pixelUpdates.size();
-	tmp = tmp >= WORLD_MAX_PIXEL_UPDATES ? WORLD_MAX_PIXEL_UPDATES : tmp;
-	memcpy((void *)(upd + offs), &tmp, sizeof(u16));
-	tmp = 0;
-	offs += sizeof(u16);
-	for(auto& px : pixelUpdates){
-		memcpy((void *)(upd + offs), &px, sizeof(pixupd_t));
-		offs += sizeof(pixupd_t);
-		if(++tmp >= WORLD_MAX_PIXEL_UPDATES){
-			break;
+
+		if (interest.getViewers(mv.cell)) {
+			net::writeCursor(cells[mv.cell].first, cur, mv.leftCell ? std::nullopt : mv.from);
 		}
 	}
-	pixelUpdates.clear();
 
-	tmp = playersLeft.size();
-	tmp = tmp >= WORLD_MAX_PLAYER_LEFT_UPDATES ? WORLD_MAX_PLAYER_LEFT_UPDATES : tmp;
-	memcpy((void *)(upd + offs), &tmp, sizeof(u8));
-	tmp = 0;
-	offs += sizeof(u8);
-	for (auto it = playersLeft.begin();;) {
-		if (it == playersLeft.end()) {
-			playersLeft.clear();
-			break;
-		}
-		if(tmp >= WORLD_MAX_PLAYER_LEFT_UPDATES){
-			playersLeft.erase(playersLeft.begin(), it);
-			pendingUpdates = true;
-			break;
+	pendingUpdates |= !playerUpdates.empty();
+
+	const sz_t pixelCount = std::min<sz_t>(pixelUpdates.size(), WORLD_MAX_PIXEL_UPDATES);
+	for (sz_t i = 0; i < pixelCount; i++) {
+		// pixupd_t is packed, its fields can't be bound to references
+		const pixupd_t& px = pixelUpdates[i];
+		u64 cell = InterestGrid::cellOf(px.x, px.y);
+		if (interest.getViewers(cell)) {
+			cells[cell].second.emplace_back(Pos{px.x}, Pos{px.y}, u8{px.r}, u8{px.g}, u8{px.b});
 		}
-		u32 pl = *it;
-		memcpy((void *)(upd + offs), &pl, sizeof(u32));
-		offs += sizeof(u32);
-		++tmp;
-		++it;
 	}
 
-	uWS::WebSocket<uWS::SERVER>::PreparedMessage * prep = uWS::WebSocket<uWS::SERVER>::prepareMessage(
-		(char *)upd, offs, uWS::BINARY, false);
-	for (Player& pl : players) {
-		pl.getClient().getWs()->sendPrepared(prep);
+	pendingUpdates |= pixelCount != pixelUpdates.size();
+	pixelUpdates.erase(pixelUpdates.begin(), pixelUpdates.begin() + pixelCount);
+	pixelUpdateIndex.clear();
+	for (sz_t i = 0; i < pixelUpdates.size(); i++) {
+		pixelUpdateIndex.emplace(key(pixelUpdates[i].x, pixelUpdates[i].y), i);
+	}
+
+	for (auto& c : cells) {
+		const std::vector<u8>& cursors = c.second.first;
+		const std::vector<u8> pixels(net::encodePixels(c.second.second));
+		std::optional<WorldUpdate> upd;
+		std::optional<WorldUpdate> pixelsOnly;
+
+		// players with too much data waiting get less, until they catch up
+		for (Player * pl : *interest.getViewers(c.first)) {
+			sz_t buffered = pl->getClient().getBufferedAmount();
+			if (buffered >= CLIENT_CURSOR_DROP_BUFFERED_BYTES && !cursors.empty()) {
+				laggingPlayers[pl].missedCursors = true;
+				pendingUpdates = true;
+			}
+
+			if (buffered >= CLIENT_STALE_BUFFERED_BYTES) {
+				if (!pixels.empty()) {
+					laggingPlayers[pl].staleCells.emplace(c.first);
+				}
+			} else if (buffered >= CLIENT_CURSOR_DROP_BUFFERED_BYTES) {
+				if (!pixels.empty()) {
+					if (!pixelsOnly) {
+						pixelsOnly.emplace(std::vector<Player::Id>(), std::vector<u8>(), pixels);
+					}
+
+					pl->send(*pixelsOnly);
+				}
+			} else {
+				if (!upd) {
+					upd.emplace(std::vector<Player::Id>(), cursors, pixels);
+				}
+
+				pl->send(*upd);
+			}
+		}
 	}
-	uWS::WebSocket<uWS::SERVER>::finalizeMessage(prep);
 
 	if (pendingUpdates) {
 		schedUpdates();
-	}*/
+	}
 }
 
 bool World::verifyChunkPos(Chunk::Pos x, Chunk::Pos y) {
@@ -233,23 +417,165 @@ bool World::verifyChunkPos(Chunk::Pos x, Chunk::Pos y) {
 		&& x >= ~border && y >= ~border;
 }
 
-Chunk& World::getChunk(Chunk::Pos x, Chunk::Pos y) {
-	auto search = chunks.find(key(x, y));
-	if (search == chunks.end()) {
-		WorldStorage::maybeConvertChunk(x, y);
+// calls f with the chunk, right away if it's loaded. otherwise the chunk file is read
+// in a worker thread, and f is called once it's ready, with nullptr if it failed
+void World::loadChunk(Chunk::Pos x, Chunk::Pos y, std::function<void(Chunk *)> f) {
+	u64 k = key(x, y);
+	auto search = chunks.find(k);
+	if (search != chunks.end()) {
+		Chunk& chunk = search->second;
+		chunk.updateLastActionTime();
+		chunk.unloadAfterSave = false; // needed again
+		lruTouch(chunk);
+		if (chunk.isLoaded()) {
+			f(&chunk);
+		} else {
+			pendingChunkLoads[k].emplace_back(std::move(f));
+		}
+
+		return;
+	}
+
+	twoi32 cluster = getClusterOf(x, y);
+	if (!isClusterConverted(cluster)) {
+		// loaded once the old cluster is converted
+		convertCluster(cluster, [this, x, y, f{std::move(f)}] (bool ok) {
+			if (!ok) {
+				// not loaded empty, it would be saved over the old one
+				f(nullptr);
+				return;
+			}
+
+			loadChunk(x, y, f);
+		});
+		return;
+	}
+
+	// can't be unloaded until the worker is done with it
+	Chunk& chunk = chunks.emplace(std::piecewise_construct,
+		std::forward_as_tuple(k),
+		std::forward_as_tuple(x, y, *this)).first->second;
 
-		search = chunks.emplace(std::piecewise_construct,
-			std::forward_as_tuple(key(x, y)),
-			std::forward_as_tuple(x, y, *this)).first;
+	++loadedChunkBlocks[key(x >> maxTileLevel, y >> maxTileLevel)];
+	lruTouch(chunk);
+	pendingChunkLoads[k].emplace_back(std::move(f));
 
-		if (chunks.size() > 64) {
-			search->second.preventUnloading(true);
-			unloadOldChunks(true);
-			search->second.preventUnloading(false);
+	if (chunks.size() > maxLoadedChunks) {
+		unloadColdestChunks(chunks.size() - maxLoadedChunks);
+	}
+
+	tb.queue([this, &chunk, k] (TaskBuffer& tb) {
+		bool ok = true;
+		try {
+			chunk.load();
+		} catch (const std::exception& e) {
+			std::cerr << "Error while loading chunk " << chunk.getX() << ", "
+			          << chunk.getY() << " of world " << getWorldName() << ": " << e.what() << std::endl;
+			ok = false;
+		}
+
+		tb.runInMainThread([this, k, ok] (TaskBuffer&) {
+			chunkLoaded(k, ok);
+		});
+	});
+}
+
+void World::convertOldClusters() {
+	// a world without players is unloaded once its conversions finish
+	if (players.empty() || !getNextOldCluster()) {
+		return;
+	}
+
+	const u32 limit = getClusterConversionLimit();
+	while (clusterConversions.size() < limit) {
+		auto next = getNextOldCluster();
+		if (!next) {
+			break;
 		}
+
+		convertCluster(*next, nullptr);
 	}
+}
 
-	return search->second;
+sz_t World::getClusterConversionsInFlight() const {
+	return clusterConversions.size();
+}
+
+// converts the cluster in a worker if it isn't already, then is called once it's done
+// with false if it failed
+void World::convertCluster(twoi32 pos, std::function<void(bool ok)> then) {
+	auto search = clusterConversions.find(pos.pos);
+	if (search == clusterConversions.end()) {
+		search = clusterConversions.emplace(pos.pos, std::vector<std::function<void(bool)>>()).first;
+
+		// the protections not found in the cluster's chunks are given back
+		auto protections = std::make_shared<std::vector<twoi32>>(beginClusterConversion(pos));
+		const RGB_u bg = getBackgroundColor();
+		tb.queue([this, pos, protections, bg] (TaskBuffer& tb) {
+			bool ok = true;
+			try {
+				WorldStorage::convertCluster(pos, *protections, bg);
+			} catch (const std::exception& e) {
+				std::cerr << "Error while converting old cluster " << pos.x << ", "
+				          << pos.y << " of world " << getWorldName() << ": " << e.what() << std::endl;
+				ok = false;
+			}
+
+			tb.runInMainThread([this, pos, protections, ok] (TaskBuffer&) {
+				clusterConverted(pos, ok, std::move(*protections));
+			});
+		});
+	}
+
+	if (then) {
+		search->second.emplace_back(std::move(then));
+	}
+}
+
+void World::clusterConverted(twoi32 pos, bool ok, std::vector<twoi32> leftProtections) {
+	endClusterConversion(pos, ok, std::move(leftProtections));
+
+	auto search = clusterConversions.find(pos.pos);
+	auto waiting(std::move(search->second));
+	clusterConversions.erase(search);
+	for (auto& f : waiting) {
+		f(ok);
+	}
+
+	convertOldClusters();
+	tryUnloadWorld();
+}
+
+// the region file is read in a worker, so that big or old files don't block the loop
+void World::openRegion(Chunk::Pos x, Chunk::Pos y, std::function<void(bool)> then) {
+	u64 k = key(x >> RegionFile::shift, y >> RegionFile::shift);
+	auto& waiting = regionOpens[k];
+	waiting.emplace_back(std::move(then));
+	if (waiting.size() > 1) {
+		return;
+	}
+
+	tb.queue([this, x, y, k] (TaskBuffer& tb) {
+		bool ok = true;
+		try {
+			WorldStorage::openRegion(x, y);
+		} catch (const std::exception& e) {
+			std::cerr << "Error while opening region file of chunk " << x << ", " << y
+			          << " of world " << getWorldName() << ": " << e.what() << std::endl;
+			ok = false;
+		}
+
+		tb.runInMainThread([this, k, ok] (TaskBuffer&) {
+			auto search = regionOpens.find(k);
+			auto waiting(std::move(search->second));
+			regionOpens.erase(search);
+			for (auto& f : waiting) {
+				f(ok);
+			}
+
+			tryUnloadWorld();
+		});
+	});
 }
 
 void World::sendUserUpdate(User& u) {
@@ -260,50 +586,90 @@ void World::sendPlayerCountStats(u32 globalPlayerCount) {
 	broadcast(Stats(getPlayerCount(), globalPlayerCount));
 }
 
-// returns true if this function ended the request before returning
-bool World::sendChunk(Chunk::Pos x, Chunk::Pos y, ll::shared_ptr<Request> req) {
+void World::sendChunk(Chunk::Pos x, Chunk::Pos y, ll::shared_ptr<Request> req) {
 	if (!verifyChunkPos(x, y)) {
 		req->writeStatus("400 Bad Request");
 		req->end();
-		return true;
+		return;
 	}
 
-	EChunkFormat fmt = isChunkOnDisk(x, y);
-	switch (fmt) {
-		case C_NONE: // if the chunk doesn't exist, don't load it
-			req->writeStatus("204 No Content");
-			req->end();
-			return true;
+	// loaded chunks can be newer than the file, or not exist on disk at all.
+	// solid chunks have a precomputed png already set as the cache
+	auto loaded = chunks.find(key(x, y));
+	if (loaded == chunks.end()) {
+		switch (isChunkOnDisk(x, y)) {
+			case C_NONE: // if the chunk doesn't exist, don't load it
+				req->writeStatus("204 No Content");
+				req->end();
+				return;
+
+			case C_PNG: { // if it's a PNG, just send it whole
+				u64 version = getChunkVersion(x, y);
+				if (!sendNotModified(*req, version)) {
+					sendChunkFile(x, y, version, std::move(req));
+				}
+			}	return;
 
-		case C_PNG: { // if it's a PNG, just send it whole. TODO: actually stream, instead of wasting memory
-			std::ifstream ch(getChunkFilePath(x, y), std::ios::binary | std::ios::ate);
-			if (!ch) {
-				// ok what
-				break;
-			}
+			case C_UNKNOWN: // asked again once the region file is open
+				openRegion(x, y, [this, x, y, req{std::move(req)}] (bool ok) {
+					if (req->isCancelled()) {
+						return;
+					}
 
-			sz_t size = ch.tellg();
-			ch.seekg(0);
-			auto data(std::make_unique<char[]>(size));
-			ch.read(data.get(), size);
-			req->end(data.get(), size);
-			return true;
-		} break;
+					if (!ok) {
+						req->writeStatus("500 Internal Server Error");
+						req->end();
+						return;
+					}
 
-		default:
-			break;
+					sendChunk(x, y, req);
+				});
+				return;
+
+			default:
+				break;
+		}
 	}
 
 	// will load the chunk if unloaded
-	Chunk& chunk = getChunk(x, y);
+	loadChunk(x, y, [this, req{std::move(req)}] (Chunk * chunk) {
+		if (req->isCancelled()) {
+			return;
+		}
+
+		if (!chunk) {
+			req->writeStatus("500 Internal Server Error");
+			req->end();
+			return;
+		}
+
+		sendLoadedChunk(*chunk, req);
+	});
+}
 
-	if (!chunk.isPngCacheOutdated()) {
-		const auto& d = chunk.getPngData();
+void World::sendLoadedChunk(Chunk& chunk, ll::shared_ptr<Request> req) {
+	const u64 version = chunk.getVersion();
+	if (sendNotModified(*req, version)) {
+		return;
+	}
+
+	if (!chunk.isPngCacheOutdated() && chunk.getPngData()) {
+		const auto& d = *chunk.getPngData();
+		writeCacheHeaders(*req, version);
 		req->end(reinterpret_cast<const char *>(d.data()), d.size());
-		return true;
+		return;
 	}
 
-	u64 k = key(x, y);
+	if (!chunk.isPngFileOutdated() && !chunk.saving) {
+		// not modified since it was loaded or saved, the file is up to date
+		sendChunkFile(chunk.getX(), chunk.getY(), version, std::move(req));
+		return;
+	}
+
+	// the png will be of this version or newer
+	writeCacheHeaders(*req, version);
+
+	u64 k = key(chunk.getX(), chunk.getY());
 	auto search = ongoingChunkRequests.find(k);
 	if (search == ongoingChunkRequests.end()) {
 		chunk.preventUnloading(true);
@@ -312,10 +678,19 @@ bool World::sendChunk(Chunk::Pos x, Chunk::Pos y, ll::shared_ptr<Request> req) {
 			std::forward_as_tuple(k),
 			std::forward_as_tuple(std::initializer_list<ll::shared_ptr<Request>>({std::move(req)}))).first;
 
-		auto end = [this, search, &chunk] (TaskBuffer& tb) {
-			const auto& d = chunk.getPngData();
+		auto end = [this, search, &chunk, k, version] (const Chunk::Png& png) {
+			const auto& d = *png;
+			// modified while it was encoding, the png can have some of the changes.
+			// it's fine for these requests, but not cached or kept as up to date
+			const bool current = chunk.getVersion() == version;
+			if (current) {
+				chunk.setPngData(png);
+				chunk.unsetCacheOutdatedFlag();
+				chunkResponses.put(this, k, version, d.data(), d.size());
+			}
+
 			for (auto& req : search->second) {
-				if (!req->isCancelled()) { // TODO: Prepared HTTP response?
+				if (!req->isCancelled()) {
 					//req->writeHeader("Content-Type", "image/png");
 					req->end(reinterpret_cast<const char *>(d.data()), d.size());
 				}
@@ -323,22 +698,388 @@ bool World::sendChunk(Chunk::Pos x, Chunk::Pos y, ll::shared_ptr<Request> req) {
 
 			ongoingChunkRequests.erase(search);
 			chunk.preventUnloading(false);
-			chunk.unsetCacheOutdatedFlag();
 			tryUnloadWorld();
 		};
 
+		// encoded to a new buffer, the cached png could be being sent or saved
 		tb.queue([&chunk, end{std::move(end)}] (TaskBuffer& tb) {
-			chunk.updatePngCache();
-			tb.runInMainThread(std::move(end));
+			Chunk::Png png(chunk.encodePng());
+			tb.runInMainThread([end, png{std::move(png)}] (TaskBuffer&) {
+				end(png);
+			});
 		});
 	} else {
 		// add this request to the list, if a png is already being encoded
 		search->second.emplace_back(std::move(req));
 	}
+}
+
+// the file is read in a worker, requests for the same chunk share the read
+void World::sendChunkFile(Chunk::Pos x, Chunk::Pos y, u64 version, ll::shared_ptr<Request> req) {
+	u64 k = key(x, y);
+	if (auto png = chunkResponses.get(this, k, version)) {
+		writeCacheHeaders(*req, version);
+		req->end(reinterpret_cast<const char *>(png->data()), png->size());
+		return;
+	}
+
+	auto search = ongoingChunkFileReads.find(k);
+	if (search != ongoingChunkFileReads.end()) {
+		search->second.emplace_back(std::move(req), version);
+		return;
+	}
+
+	ongoingChunkFileReads[k].emplace_back(std::move(req), version);
+
+	tb.queue([this, x, y, k] (TaskBuffer& tb) {
+		// shared, the main thread callback must be copyable
+		auto file = std::make_shared<RegionFile::View>();
+		auto oldFile = std::make_shared<std::vector<u8>>();
+		bool ok = true;
+		try {
+			*file = mapChunk(x, y);
+			if (*file) {
+				file->prefault();
+			} else {
+				// old chunk files aren't mapped
+				readChunk(x, y, *oldFile);
+			}
+		} catch (const std::runtime_error& e) {
+			std::cerr << "Error while reading chunk: " << e.what() << std::endl;
+			ok = false;
+		}
+
+		tb.runInMainThread([this, k, file{std::move(file)}, oldFile{std::move(oldFile)}, ok] (TaskBuffer&) {
+			auto search = ongoingChunkFileReads.find(k);
+			const char * d = reinterpret_cast<const char *>(*file ? file->data() : oldFile->data());
+			const sz_t size = *file ? file->size() : oldFile->size();
+			if (ok && size != 0) {
+				// the version is checked before reading, a newer file won't be used
+				chunkResponses.put(this, k, search->second.front().second, reinterpret_cast<const u8 *>(d), size);
+			}
+
+			for (auto& r : search->second) {
+				auto& req = r.first;
+				if (req->isCancelled()) {
+					continue;
+				}
+
+				if (!ok) {
+					req->writeStatus("500 Internal Server Error");
+					req->end();
+				} else if (size == 0) {
+					// deleted while it was being read
+					req->writeStatus("204 No Content");
+					req->end();
+				} else {
+					writeCacheHeaders(*req, r.second);
+					req->end(d, size);
+				}
+			}
+
+			ongoingChunkFileReads.erase(search);
+			// unpinned before the world can be unloaded with its region files,
+			// the captures are only destroyed after this returns
+			file->reset();
+			tryUnloadWorld();
+		});
+	});
+}
+
+void World::sendTile(u8 level, Chunk::Pos x, Chunk::Pos y, ll::shared_ptr<Request> req) {
+	// checked one at a time so that the multiplication can't overflow
+	if (level == 0 || level > maxTileLevel || !verifyChunkPos(x, y)
+			|| !verifyChunkPos(x * (1 << level), y * (1 << level))) {
+		req->writeStatus("400 Bad Request");
+		req->end();
+		return;
+	}
+
+	static_assert(maxTileLevel <= RegionFile::shift, "tiles must fit in one region");
+	if (!isRegionOpen(x << level, y << level)) {
+		openRegion(x << level, y << level, [this, level, x, y, req{std::move(req)}] (bool ok) {
+			if (req->isCancelled()) {
+				return;
+			}
+
+			if (!ok) {
+				req->writeStatus("500 Internal Server Error");
+				req->end();
+				return;
+			}
+
+			sendTile(level, x, y, req);
+		});
+		return;
+	}
+
+	if (!tileHasChunks(level, x, y)) {
+		req->writeStatus("204 No Content");
+		req->end();
+		return;
+	}
+
+	loadTile(level, x, y, [req{std::move(req)}] (const std::vector<u8> * png, u64 version) {
+		if (req->isCancelled()) {
+			return;
+		}
+
+		if (!png) {
+			req->writeStatus("500 Internal Server Error");
+			req->end();
+			return;
+		}
+
+		if (sendNotModified(*req, version)) {
+			return;
+		}
+
+		writeCacheHeaders(*req, version);
+		req->end(reinterpret_cast<const char *>(png->data()), png->size());
+	});
+}
+
+// the region of the tile must be open
+bool World::tileHasChunks(u8 level, Chunk::Pos x, Chunk::Pos y) const {
+	const Chunk::Pos n = 1 << level;
+	if (isAreaOnDisk(x * n, y * n, n) != C_NONE) {
+		return true;
+	}
+
+	// new chunks aren't on disk yet
+	if (!loadedChunkBlocks.count(key(x * n >> maxTileLevel, y * n >> maxTileLevel))) {
+		return false;
+	} else if (level == maxTileLevel) {
+		return true;
+	}
+
+	for (Chunk::Pos cy = y * n; cy < y * n + n; cy++) {
+		for (Chunk::Pos cx = x * n; cx < x * n + n; cx++) {
+			if (chunks.find(key(cx, cy)) != chunks.end()) {
+				return true;
+			}
+		}
+	}
 
 	return false;
 }
 
+// calls f with the png of the tile, built in a worker thread if it isn't cached or
+// was modified. f is called with nullptr if it failed
+void World::loadTile(u8 level, Chunk::Pos x, Chunk::Pos y, std::function<void(const std::vector<u8> *, u64 version)> f) {
+	u64 k = key(x, y);
+	TileState& tile = tiles[{level, k}];
+	if (!tile.building) {
+		if (auto png = chunkResponses.get(this, k, tile.version, level)) {
+			f(png, tile.version);
+			return;
+		}
+	}
+
+	tile.waiting.emplace_back(std::move(f));
+	if (!tile.building) {
+		tile.building = true;
+		tile.dirty = false;
+		tile.version = nextTileVersion++;
+		buildTile(level, x, y);
+	}
+}
+
+// tiles are made of 4 chunks, or 4 tiles of the level below
+void World::buildTile(u8 level, Chunk::Pos x, Chunk::Pos y) {
+	if (level == 1) {
+		for (u32 i = 0; i < 4; i++) {
+			twoi32 cluster = getClusterOf(x * 2 + (i & 1), y * 2 + (i >> 1));
+			if (!isClusterConverted(cluster)) {
+				convertCluster(cluster, [this, level, x, y] (bool ok) {
+					if (ok) {
+						buildTile(level, x, y);
+					} else {
+						++tileBuildsInFlight;
+						tileBuilt(level, key(x, y), nullptr, false);
+					}
+				});
+				return;
+			}
+		}
+	}
+
+	++tileBuildsInFlight;
+
+	if (level == 1) {
+		// loaded chunks can be newer than their file
+		std::array<Chunk *, 4> loaded{};
+		for (u32 i = 0; i < 4; i++) {
+			auto search = chunks.find(key(x * 2 + (i & 1), y * 2 + (i >> 1)));
+			if (search != chunks.end() && search->second.isLoaded()) {
+				loaded[i] = &search->second;
+				loaded[i]->preventUnloading(true);
+			}
+		}
+
+		downscaleTile(level, x, y, loaded, nullptr);
+		return;
+	}
+
+	struct Parts {
+		std::shared_ptr<std::array<std::vector<u8>, 4>> pngs;
+		u32 remaining;
+		bool failed;
+	};
+
+	// one extra count so that cached tiles don't finish before all are requested
+	auto parts = std::make_shared<Parts>(Parts{std::make_shared<std::array<std::vector<u8>, 4>>(), 1, false});
+	auto done = [this, level, x, y, parts] {
+		if (--parts->remaining != 0) {
+			return;
+		}
+
+		if (parts->failed) {
+			tileBuilt(level, key(x, y), nullptr, false);
+		} else {
+			downscaleTile(level, x, y, {}, parts->pngs);
+		}
+	};
+
+	for (u32 i = 0; i < 4; i++) {
+		Chunk::Pos tx = x * 2 + (i & 1);
+		Chunk::Pos ty = y * 2 + (i >> 1);
+		if (!tileHasChunks(level - 1, tx, ty)) {
+			continue; // stays empty
+		}
+
+		++parts->remaining;
+		loadTile(level - 1, tx, ty, [parts, done, i] (const std::vector<u8> * png, u64) {
+			if (png) {
+				(*parts->pngs)[i] = *png;
+			} else {
+				parts->failed = true;
+			}
+
+			done();
+		});
+	}
+
+	done();
+}
+
+// the parts are read, scaled down and encoded in a worker
+void World::downscaleTile(u8 level, Chunk::Pos x, Chunk::Pos y, std::array<Chunk *, 4> loaded,
+		std::shared_ptr<std::array<std::vector<u8>, 4>> parts) {
+	const RGB_u bg = getBackgroundColor();
+	tb.queue([this, level, x, y, bg, loaded, parts{std::move(parts)}] (TaskBuffer& tb) {
+		constexpr sz_t stride = Chunk::size * 3;
+		constexpr sz_t half = Chunk::size / 2;
+		auto png = std::make_shared<std::vector<u8>>();
+		bool ok = true;
+		try {
+			std::vector<u8> pixels(stride * Chunk::size);
+			for (sz_t i = 0; i < pixels.size(); i += 3) {
+				pixels[i] = bg.r;
+				pixels[i + 1] = bg.g;
+				pixels[i + 2] = bg.b;
+			}
+
+			for (u32 i = 0; i < 4; i++) {
+				u8 * quadrant = pixels.data() + (i >> 1) * half * stride + (i & 1) * half * 3;
+				Chunk::Pos cx = x * 2 + (i & 1);
+				Chunk::Pos cy = y * 2 + (i >> 1);
+				if (parts) {
+					auto& part = (*parts)[i];
+					if (!part.empty()) {
+						downscalePng(part.data(), part.size(), bg, quadrant, stride);
+					}
+				} else if (loaded[i]) {
+					loaded[i]->downscale(quadrant, stride);
+				} else if (RegionFile::View file = mapChunk(cx, cy)) {
+					downscalePng(file.data(), file.size(), bg, quadrant, stride);
+				} else {
+					// old chunk files aren't mapped
+					std::vector<u8> old;
+					if (readChunk(cx, cy, old) && !old.empty()) {
+						downscalePng(old.data(), old.size(), bg, quadrant, stride);
+					}
+				}
+			}
+
+			IncrementalPngEncoder enc(Chunk::size, Chunk::size);
+			enc.encode(*png, IncrementalPngEncoder::RGB, [&pixels] (u32 y) {
+				return pixels.data() + y * stride;
+			});
+		} catch (const std::exception& e) {
+			std::cerr << "Error while building tile " << x << ", " << y << " (level " << +level
+			          << ") of world " << getWorldName() << ": " << e.what() << std::endl;
+			ok = false;
+		}
+
+		tb.runInMainThread([this, level, k{key(x, y)}, loaded, png{std::move(png)}, ok] (TaskBuffer&) {
+			for (Chunk * c : loaded) {
+				if (c) {
+					c->preventUnloading(false);
+				}
+			}
+
+			tileBuilt(level, k, png, ok);
+		});
+	});
+}
+
+void World::tileBuilt(u8 level, u64 k, std::shared_ptr<std::vector<u8>> png, bool ok) {
+	--tileBuildsInFlight;
+	auto it = tiles.find({level, k});
+	TileState& tile = it->second;
+	auto waiting(std::move(tile.waiting));
+	u64 version = tile.version;
+	tile.waiting.clear();
+	tile.building = false;
+
+	if (ok && !tile.dirty) {
+		chunkResponses.put(this, k, tile.version, png->data(), png->size(), level);
+	} else {
+		// built again on the next request
+		tiles.erase(it);
+	}
+
+	// the requests made before the modification can still get this one
+	for (auto& f : waiting) {
+		f(ok ? png.get() : nullptr, version);
+	}
+
+	tryUnloadWorld();
+}
+
+// called when pixels of a chunk change, the tiles containing it are thrown away
+void World::markTilesDirty(Chunk::Pos x, Chunk::Pos y) {
+	if (tiles.empty()) {
+		return;
+	}
+
+	for (u8 level = 1; level <= maxTileLevel; level++) {
+		auto it = tiles.find({level, key(x >> level, y >> level)});
+		if (it == tiles.end()) {
+			continue;
+		}
+
+		if (it->second.building) {
+			it->second.dirty = true;
+		} else {
+			chunkResponses.erase(this, it->first.second, level);
+			tiles.erase(it);
+		}
+	}
+}
+
+void World::forgetEvictedTiles() {
+	for (auto it = tiles.begin(); it != tiles.end();) {
+		const TileState& tile = it->second;
+		if (!tile.building && !chunkResponses.has(this, it->first.second, tile.version, it->first.first)) {
+			it = tiles.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
 /*void World::cancelChunkRequest(Chunk::Pos x, Chunk::Pos y, uWS::HttpResponse * res) {
 	auto search = ongoingChunkRequests.find(key(x, y));
 	if (search != ongoingChunkRequests.end()) {
@@ -352,39 +1093,145 @@ void World::chat(Player& p, const std::string& s) {
 	broadcast(ChatMessage(p.getUser().getId(), s));
 }
 
-// returns false when you were not allowed to paint, or position is out of range
-bool World::paint(Player& p, World::Pos x, World::Pos y, RGB_u clr) {
+// ignored if the position is out of range. if the chunk is still loading, the
+// paint is queued and the protections are checked once it's ready
+void World::paint(Player& p, World::Pos x, World::Pos y, RGB_u clr) {
 	Chunk::Pos cx = x >> Chunk::posShift;
 	Chunk::Pos cy = y >> Chunk::posShift;
 
 	if (!verifyChunkPos(cx, cy)) {
-		return false;
+		return;
 	}
 
-	Chunk& chunk = getChunk(cx, cy);
+	loadChunk(cx, cy, [this, pl{&p}, pid{p.getPid()}, x, y, clr] (Chunk * chunk) {
+		// the player could have left while the chunk was loading
+		if (!chunk || !isPlayerHere(pl, pid) || !isActionPaintAllowed(*chunk, x, y, *pl)) {
+			return;
+		}
 
-	if (isActionPaintAllowed(chunk, x, y, p)) {
-		if (chunk.setPixel(x, y, clr)) {
-			pixelUpdates.push_back({p.getPid(), x, y, clr.r, clr.g, clr.b});
-			schedUpdates();
+		if (chunk->setPixel(x, y, clr)) {
+			markTilesDirty(chunk->getX(), chunk->getY());
+			queuePixelUpdate({pid, x, y, clr.r, clr.g, clr.b});
 		}
+	});
+}
 
-		return true;
+void World::paint(Player& p, std::vector<pixupd_t> px) {
+	// pixupd_t is packed, the fields are copied out before use
+	auto chunkOf = [] (const pixupd_t& u) {
+		const World::Pos x = u.x;
+		const World::Pos y = u.y;
+		return std::make_pair(y >> Chunk::posShift, x >> Chunk::posShift);
+	};
+
+	auto cellOf = [] (const pixupd_t& u) {
+		const World::Pos x = u.x;
+		const World::Pos y = u.y;
+		return std::make_pair(y >> Chunk::pSizeShift, x >> Chunk::pSizeShift);
+	};
+
+	px.erase(std::remove_if(px.begin(), px.end(), [&chunkOf] (const pixupd_t& u) {
+		auto c = chunkOf(u);
+		return !verifyChunkPos(c.second, c.first);
+	}), px.end());
+
+	// stable, a pixel painted twice in the shape keeps its last color
+	std::stable_sort(px.begin(), px.end(), [&] (const pixupd_t& a, const pixupd_t& b) {
+		auto ca = chunkOf(a);
+		auto cb = chunkOf(b);
+		return ca < cb || (ca == cb && cellOf(a) < cellOf(b));
+	});
+
+	for (auto it = px.begin(); it != px.end();) {
+		const auto chunkPos = chunkOf(*it);
+		auto end = std::find_if(it, px.end(), [&] (const pixupd_t& u) {
+			return chunkOf(u) != chunkPos;
+		});
+
+		loadChunk(chunkPos.second, chunkPos.first, [this, pl{&p}, pid{p.getPid()}, cellOf,
+				group{std::vector<pixupd_t>(it, end)}] (Chunk * chunk) {
+			if (!chunk || !isPlayerHere(pl, pid)) {
+				return;
+			}
+
+			bool changed = false;
+			for (auto c = group.begin(); c != group.end();) {
+				const auto cell = cellOf(*c);
+				auto cellEnd = std::find_if(c, group.end(), [&] (const pixupd_t& u) {
+					return cellOf(u) != cell;
+				});
+
+				if (!isActionPaintAllowed(*chunk, c->x, c->y, *pl)) {
+					c = cellEnd;
+					continue;
+				}
+
+				for (; c != cellEnd; ++c) {
+					RGB_u clr;
+					clr.r = c->r;
+					clr.g = c->g;
+					clr.b = c->b;
+					clr.a = 255;
+					if (chunk->setPixel(c->x, c->y, clr)) {
+						queuePixelUpdate(*c);
+						changed = true;
+					}
+				}
+			}
+
+			if (changed) {
+				markTilesDirty(chunk->getX(), chunk->getY());
+			}
+		});
+
+		it = end;
 	}
+}
 
-	return false;
+bool World::canManageProtections(const User& u) const {
+	auto owner = getOwner();
+	return u.getUviasRank().isSuperUser() || (owner && *owner == u.getId());
 }
 
-void World::setAreaProtection(Chunk::ProtPos x, Chunk::ProtPos y, bool state) {
-	Chunk& chunk = getChunk(x >> Chunk::pcShift, y >> Chunk::pcShift);
-	u32 newState = state ? 1 : 0; // these numbers should have a special meaning
+bool World::setAreaProtection(Chunk::ProtPos x, Chunk::ProtPos y, u32 w, u32 h, bool state) {
+	if (w == 0 || h == 0 || w > border || h > border) {
+		return false;
+	}
+
+	const i64 lastX = i64(x) + w - 1;
+	const i64 lastY = i64(y) + h - 1;
+	const i64 firstCx = x >> Chunk::pcShift;
+	const i64 firstCy = y >> Chunk::pcShift;
+	const i64 lastCx = lastX >> Chunk::pcShift;
+	const i64 lastCy = lastY >> Chunk::pcShift;
+	if (lastCx > border || lastCy > border || !verifyChunkPos(firstCx, firstCy)
+			|| (lastCx - firstCx + 1) * (lastCy - firstCy + 1) > WORLD_MAX_PROTECTION_AREA_CHUNKS) {
+		return false;
+	}
 
-	// x and y are 16x16 aligned
-	chunk.setProtectionGid(x, y, newState);
+	const u32 newState = state ? 1 : 0; // these numbers should have a special meaning
+
+	for (i64 cy = firstCy; cy <= lastCy; cy++) {
+		for (i64 cx = firstCx; cx <= lastCx; cx++) {
+			// the part of the area in this chunk
+			const i64 ax = std::max<i64>(x, cx * Chunk::pc);
+			const i64 ay = std::max<i64>(y, cy * Chunk::pc);
+			const u32 aw = std::min<i64>(lastX, cx * Chunk::pc + Chunk::pc - 1) - ax + 1;
+			const u32 ah = std::min<i64>(lastY, cy * Chunk::pc + Chunk::pc - 1) - ay + 1;
+
+			loadChunk(cx, cy, [this, ax, ay, aw, ah, newState] (Chunk * chunk) {
+				if (!chunk || !chunk->setProtectionArea(ax, ay, aw, ah, newState)) {
+					return;
+				}
 
-	if (players.size() != 0) {
-		broadcast(ProtectionUpdate(x, y, newState));
+				if (players.size() != 0) {
+					broadcast(ChunkProtectionUpdate(chunk->getX(), chunk->getY(), chunk->getProtectionRle()));
+				}
+			});
+		}
 	}
+
+	return true;
 }
 
 void World::broadcast(const PrepMsg& prep) {
@@ -393,12 +1240,18 @@ void World::broadcast(const PrepMsg& prep) {
 	}
 }
 
+// chunks are written in the background, returns true if any was queued
 bool World::save() {
 	bool didStuff = false;
-	for (auto& chunk : chunks) {
-		didStuff |= chunk.second.save();
+	for (Chunk * c = lruTail; c != nullptr; c = c->lruPrev) {
+		// chunks being loaded are still owned by a worker
+		if (c->isLoaded() && c->isPngFileOutdated()) {
+			queueSave(*c);
+			didStuff = true;
+		}
 	}
 
+	startQueuedSaves();
 	didStuff |= WorldStorage::save();
 	return didStuff;
 }
@@ -426,16 +1279,247 @@ bool World::isActionPaintAllowed(const Chunk& c, World::Pos x, World::Pos y, Pla
 	return c.getProtectionGid(x, y) == 0 /*|| rank >= Client::MODERATOR*/;
 }
 
-bool World::tryUnloadAllChunks() {
-	for (auto it = chunks.begin(); it != chunks.end();) {
-		it = it->second.shouldUnload(true) ? chunks.erase(it) : std::next(it);
+bool World::isPlayerHere(const Player * pl, Player::Id pid) const {
+	auto it = std::find_if(players.begin(), players.end(), [pl, pid] (const Player& p) {
+		return &p == pl && p.getPid() == pid;
+	});
+
+	return it != players.end();
+}
+
+void World::lruTouch(Chunk& c) {
+	if (lruHead == &c) {
+		return;
+	}
+
+	if (c.lruPrev) { // already in the list
+		lruRemove(c);
+	}
+
+	c.lruPrev = nullptr;
+	c.lruNext = lruHead;
+	if (lruHead) {
+		lruHead->lruPrev = &c;
+	}
+
+	lruHead = &c;
+	if (!lruTail) {
+		lruTail = &c;
+	}
+}
+
+void World::lruRemove(Chunk& c) {
+	(c.lruPrev ? c.lruPrev->lruNext : lruHead) = c.lruNext;
+	(c.lruNext ? c.lruNext->lruPrev : lruTail) = c.lruPrev;
+	c.lruPrev = nullptr;
+	c.lruNext = nullptr;
+}
+
+// returns false if the chunk has to be saved first, it's unloaded once it is
+bool World::unloadChunk(Chunk& c) {
+	if (c.isLoaded() && !c.isChunkEmpty() && c.isPngFileOutdated()) {
+		// let a worker save it first, the destructor would block
+		c.unloadAfterSave = true;
+		queueSave(c);
+		startQueuedSaves();
+		return false;
+	}
+
+	eraseChunk(c); // deletes the file if empty
+	return true;
+}
+
+void World::eraseChunk(Chunk& c) {
+	u64 block = key(c.getX() >> maxTileLevel, c.getY() >> maxTileLevel);
+	auto search = loadedChunkBlocks.find(block);
+	if (--search->second == 0) {
+		loadedChunkBlocks.erase(search);
+	}
+
+	lruRemove(c);
+	chunks.erase(key(c.getX(), c.getY()));
+}
+
+// players that caught up get the cursors they missed, and the areas with
+// dropped pixel updates to fetch again
+void World::resyncLaggingPlayers() {
+	for (auto it = laggingPlayers.begin(); it != laggingPlayers.end();) {
+		Player& pl = *it->first;
+		if (pl.getClient().getBufferedAmount() >= CLIENT_CURSOR_DROP_BUFFERED_BYTES) {
+			++it;
+			continue;
+		}
+
+		if (it->second.missedCursors) {
+			sendCursorsIn(pl, interest.getViewCells(pl));
+		}
+
+		if (!it->second.staleCells.empty()) {
+			std::vector<std::tuple<Chunk::Pos, Chunk::Pos>> areas;
+			areas.reserve(it->second.staleCells.size());
+			for (u64 cell : it->second.staleCells) {
+				areas.emplace_back(InterestGrid::firstChunkOf(cell));
+			}
+
+			ChunksStale::one(pl.getClient().getWs(), WORLD_INTEREST_CELL_CHUNKS, std::move(areas));
+		}
+
+		it = laggingPlayers.erase(it);
+	}
+}
+
+// a pixel painted many times in a tick is only sent once, with its last color
+void World::queuePixelUpdate(const pixupd_t& px) {
+	auto ins = pixelUpdateIndex.emplace(key(px.x, px.y), pixelUpdates.size());
+	if (ins.second) {
+		pixelUpdates.emplace_back(px);
+	} else {
+		pixelUpdates[ins.first->second] = px;
+	}
+
+	schedUpdates();
+}
+
+void World::chunkLoaded(u64 k, bool ok) {
+	Chunk& chunk = chunks.at(k);
+	auto search = pendingChunkLoads.find(k);
+	std::vector<std::function<void(Chunk *)>> waiting(std::move(search->second));
+	pendingChunkLoads.erase(search);
+
+	if (!ok) {
+		// not saved or deleted, since it didn't load
+		eraseChunk(chunk);
+		for (auto& f : waiting) {
+			f(nullptr);
+		}
+
+		tryUnloadWorld();
+		return;
 	}
 
+	chunk.setLoaded();
+	chunk.preventUnloading(false);
+
+	// replay the paints and requests in the order they were received
+	for (auto& f : waiting) {
+		f(&chunk);
+	}
+}
+
+void World::queueSave(Chunk& c) {
+	if (!c.saveQueued) {
+		c.saveQueued = true;
+		saveQueue.push_back(key(c.getX(), c.getY()));
+	}
+}
+
+void World::startQueuedSaves() {
+	while (savesInFlight < WORLD_MAX_CHUNK_SAVES_IN_FLIGHT && !saveQueue.empty()) {
+		u64 k = saveQueue.front();
+		saveQueue.pop_front();
+
+		auto search = chunks.find(k);
+		if (search == chunks.end()) {
+			continue;
+		}
+
+		Chunk& chunk = search->second;
+		chunk.saveQueued = false;
+		// one that's being written is queued again if it changed meanwhile
+		if (!chunk.isPngFileOutdated() || chunk.saving) {
+			continue;
+		}
+
+		// the outdated flag is only cleared once the file is written. the worker
+		// encodes to its own buffer if the cached png is outdated, it's never
+		// modified while requests could be reading it
+		Chunk::Png cached(chunk.isPngCacheOutdated() ? nullptr : chunk.getPngData());
+		u64 version = chunk.getVersion();
+		chunk.preventUnloading(true);
+		chunk.saving = true;
+		++savesInFlight;
+
+		tb.queue([this, &chunk, k, cached{std::move(cached)}, version] (TaskBuffer& tb) {
+			Chunk::Png encoded;
+			bool ok = true;
+			try {
+				if (!cached) {
+					encoded = chunk.encodePng();
+				}
+
+				chunk.writePngFile(cached ? *cached : *encoded, version);
+			} catch (const std::exception& e) {
+				std::cerr << "Error while saving chunk: " << e.what() << std::endl;
+				ok = false;
+			}
+
+			tb.runInMainThread([this, k, encoded{std::move(encoded)}, version, ok] (TaskBuffer&) {
+				chunkSaved(k, encoded, version, ok);
+			});
+		});
+	}
+}
+
+void World::chunkSaved(u64 k, Chunk::Png encoded, u64 version, bool ok) {
+	Chunk& chunk = chunks.at(k);
+	--savesInFlight;
+	chunk.preventUnloading(false);
+	chunk.saving = false;
+
+	if (encoded && chunk.getVersion() == version) {
+		chunk.setPngData(std::move(encoded));
+		chunk.unsetCacheOutdatedFlag();
+	}
+
+	if (ok && chunk.getVersion() == version) {
+		// not modified while it was being written
+		chunk.unsetFileOutdatedFlag();
+	} else if (ok && chunk.unloadAfterSave) {
+		queueSave(chunk);
+	}
+
+	if (chunk.unloadAfterSave && chunk.shouldUnload(true)) {
+		chunk.unloadAfterSave = false;
+		if (ok) {
+			unloadChunk(chunk);
+		} else {
+			// don't retry forever, the destructor will try once more
+			eraseChunk(chunk);
+		}
+	}
+
+	startQueuedSaves();
+	tryUnloadWorld();
+}
+
+// blocks, for when the workers are stopped. the saves they were doing
+// are still marked outdated, so they're written again
+bool World::saveNow() {
+	bool didStuff = false;
+	saveQueue.clear();
+	for (Chunk * c = lruTail; c != nullptr; c = c->lruPrev) {
+		c->saveQueued = false;
+		try {
+			didStuff |= c->isLoaded() && c->save();
+		} catch (const std::exception& e) {
+			std::cerr << "Error while saving chunk " << c->getX() << ", " << c->getY()
+			          << " of world " << getWorldName() << ": " << e.what() << std::endl;
+		}
+	}
+
+	didStuff |= WorldStorage::save();
+	return didStuff;
+}
+
+bool World::tryUnloadAllChunks() {
+	unloadOldChunks(true);
 	return chunks.size() == 0;
 }
 
 void World::tryUnloadWorld() {
-	if (!players.size() && tryUnloadAllChunks()) {
+	// the workers reading chunk files still need this world
+	if (!players.size() && ongoingChunkFileReads.empty() && tileBuildsInFlight == 0
+			&& clusterConversions.empty() && regionOpens.empty() && tryUnloadAllChunks()) {
 		unload();
 	}
 }
@@ -4,6 +4,7 @@
 #include <Chunk.hpp>
 #include <Player.hpp>
 #include <User.hpp>
+#include <InterestGrid.hpp>
 #include <types.hpp>
 
 #include <color.hpp>
@@ -14,14 +15,19 @@
 #include <string>
 #include <set>
 #include <unordered_map>
+#include <unordered_set>
 #include <map>
+#include <deque>
 #include <optional>
 #include <vector>
 #include <tuple>
+#include <array>
 #include <memory>
 #include <limits>
+#include <chrono>
 
 class TaskBuffer;
+class ChunkResponseCache;
 class Client;
 class Request;
 
@@ -30,10 +36,19 @@ public:
 	using Pos = i32;
 
 	static constexpr Chunk::Pos border = std::numeric_limits<Pos>::max() / Chunk::size;
+	static constexpr u8 maxTileLevel = 4; // tiles of up to 16x16 chunks
 
 private:
+	struct TileState {
+		u64 version; // of the png in the response cache
+		bool building;
+		bool dirty; // modified while it was being built
+		std::vector<std::function<void(const std::vector<u8> *, u64 version)>> waiting;
+	};
+
 	IdSys<Player::Id> ids;
 	TaskBuffer& tb; // for http chunk requests
+	ChunkResponseCache& chunkResponses;
 	bool updateRequired;
 	bool drawRestricted; // TODO: use to restrict drawing to owner only
 
@@ -41,14 +56,45 @@ private:
 
 	std::set<std::reference_wrapper<Player>> players;
 	std::unordered_map<u64, Chunk> chunks;
+	// intrusive list of the loaded chunks, from most to least recently used
+	Chunk * lruHead;
+	Chunk * lruTail;
+	sz_t maxLoadedChunks;
+	// loaded chunks per square of the biggest tile size, so that tile requests
+	// don't have to look up every chunk
+	std::unordered_map<u64, u32> loadedChunkBlocks;
 	std::map<u64, std::vector<ll::shared_ptr<Request>>> ongoingChunkRequests;
-
-	std::vector<pixupd_t> pixelUpdates;
-	std::set<std::reference_wrapper<Player>> playerUpdates;
-	std::set<Player::Id> playersLeft; // this might be removed
+	// the requests with the chunk version they'll be sent as
+	std::map<u64, std::vector<std::pair<ll::shared_ptr<Request>, u64>>> ongoingChunkFileReads;
+	std::map<u64, std::vector<std::function<void(Chunk *)>>> pendingChunkLoads;
+	std::deque<u64> saveQueue; // chunks waiting to be written by a worker
+	sz_t savesInFlight;
+	// downscaled tiles built or being built, (level, key) -> state
+	std::map<std::pair<u8, u64>, TileState> tiles;
+	u64 nextTileVersion;
+	sz_t tileBuildsInFlight;
+	// old clusters being converted by workers -> functions waiting for them
+	std::map<u64, std::vector<std::function<void(bool ok)>>> clusterConversions;
+	// region files being opened by workers -> functions waiting for them
+	std::map<u64, std::vector<std::function<void(bool)>>> regionOpens;
+
+	InterestGrid interest; // who sees what, for the updates
+	struct Lag {
+		bool missedCursors;
+		std::set<u64> staleCells; // pixel updates were dropped here
+	};
+	// players too far behind on updates, resynced once they catch up
+	std::unordered_map<Player *, Lag> laggingPlayers;
+
+	std::vector<pixupd_t> pixelUpdates; // one per pixel, with its last color
+	std::unordered_map<u64, sz_t> pixelUpdateIndex; // pixel pos -> index in pixelUpdates
+	// sent oldest first, so that under load every cursor gets its turn
+	std::deque<Player *> playerUpdates;
+	std::unordered_set<Player *> queuedPlayerUpdates; // the players in playerUpdates
+	std::deque<Player::Id> playersLeft;
 
 public:
-	World(std::tuple<std::string, std::string>, TaskBuffer&);
+	World(std::tuple<std::string, std::string>, TaskBuffer&, ChunkResponseCache&);
 	~World();
 
 	World(const World&) = delete;
@@ -59,28 +105,45 @@ public:
 	void playerJoined(Player&);
 	void playerUpdated(Player&);
 	void playerLeft(Player&);
+	// x, y, w and h are in chunks, only updates in the viewport are sent to the player
+	void setViewport(Player&, Chunk::Pos x, Chunk::Pos y, u32 w, u32 h);
 
 	void schedUpdates();
 	void sendUpdates();
 
 	sz_t unloadOldChunks(bool force = false);
+	sz_t unloadColdestChunks(sz_t count);
+	sz_t getLoadedChunkCount() const;
+	sz_t getClusterConversionsInFlight() const;
+
+	// starts background conversions of old clusters, up to the world's limit
+	void convertOldClusters();
+	std::optional<std::chrono::steady_clock::time_point> getColdestChunkTime() const;
 
 	static bool verifyChunkPos(Chunk::Pos x, Chunk::Pos y);
-	Chunk& getChunk(Chunk::Pos x, Chunk::Pos y);
+	void loadChunk(Chunk::Pos x, Chunk::Pos y, std::function<void(Chunk *)>);
 
 	void sendUserUpdate(User&);
 	void sendPlayerCountStats(u32 globalPlayerCount);
-	bool sendChunk(Chunk::Pos x, Chunk::Pos y, ll::shared_ptr<Request>);
+	void sendChunk(Chunk::Pos x, Chunk::Pos y, ll::shared_ptr<Request>);
+	// x and y are in tiles of 2^level chunks
+	void sendTile(u8 level, Chunk::Pos x, Chunk::Pos y, ll::shared_ptr<Request>);
 	//void cancelChunkRequest(Chunk::Pos x, Chunk::Pos y, ll::shared_ptr<Request>);
 
-	void setAreaProtection(Chunk::ProtPos x, Chunk::ProtPos y, bool state);
+	bool canManageProtections(const User&) const;
+	// x, y, w and h are in protection cells, returns false if the area is invalid.
+	// every chunk modified gets one update with all its cells
+	bool setAreaProtection(Chunk::ProtPos x, Chunk::ProtPos y, u32 w, u32 h, bool state);
 
-	bool paint(Player&, World::Pos x, World::Pos y, RGB_u);
+	void paint(Player&, World::Pos x, World::Pos y, RGB_u);
+	// applied chunk by chunk, protections are checked once per cell
+	void paint(Player&, std::vector<pixupd_t>);
 
 	void chat(Player&, const std::string&);
 	void broadcast(const PrepMsg&);
 
 	bool save();
+	bool saveNow();
 
 	sz_t getPlayerCount() const;
 	std::string_view getMotd() const;
@@ -90,6 +153,31 @@ public:
 
 private:
 	bool isActionPaintAllowed(const Chunk&,  World::Pos x,  World::Pos y, Player&);
+	bool isPlayerHere(const Player *, Player::Id) const;
+	void sendLoadedChunk(Chunk&, ll::shared_ptr<Request>);
+	void sendChunkFile(Chunk::Pos x, Chunk::Pos y, u64 version, ll::shared_ptr<Request>);
+	void chunkLoaded(u64 key, bool ok);
+	void convertCluster(twoi32, std::function<void(bool ok)> then);
+	void openRegion(Chunk::Pos x, Chunk::Pos y, std::function<void(bool ok)> then);
+	void clusterConverted(twoi32, bool ok, std::vector<twoi32> leftProtections);
+	bool tileHasChunks(u8 level, Chunk::Pos x, Chunk::Pos y) const;
+	void loadTile(u8 level, Chunk::Pos x, Chunk::Pos y, std::function<void(const std::vector<u8> *, u64 version)>);
+	void buildTile(u8 level, Chunk::Pos x, Chunk::Pos y);
+	void downscaleTile(u8 level, Chunk::Pos x, Chunk::Pos y, std::array<Chunk *, 4> loaded,
+		std::shared_ptr<std::array<std::vector<u8>, 4>> parts);
+	void tileBuilt(u8 level, u64 key, std::shared_ptr<std::vector<u8>> png, bool ok);
+	void markTilesDirty(Chunk::Pos x, Chunk::Pos y);
+	void forgetEvictedTiles();
+	void sendCursorsIn(Player&, const std::vector<u64>& cells);
+	void resyncLaggingPlayers();
+	void queuePixelUpdate(const pixupd_t&);
+	void queueSave(Chunk&);
+	void startQueuedSaves();
+	void chunkSaved(u64 key, Chunk::Png encoded, u64 version, bool ok);
+	void lruTouch(Chunk&);
+	void lruRemove(Chunk&);
+	void eraseChunk(Chunk&);
+	bool unloadChunk(Chunk&);
 	bool tryUnloadAllChunks();
 	void tryUnloadWorld();
 };
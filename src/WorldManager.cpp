@@ -2,12 +2,17 @@
 
 #include <iostream>
 #include <utility>
+#include <unordered_set>
 #include <Storage.hpp>
+#include <config.hpp>
 //#include <TaskBuffer.hpp>
 #include <TimedCallbacks.hpp>
 
+#include <nlohmann/json.hpp>
+
 WorldManager::WorldManager(TaskBuffer& tb, TimedCallbacks& tc, Storage& s)
-: tb(tb),
+: chunkResponses(WORLD_CHUNK_RESPONSE_CACHE_BYTES),
+  tb(tb),
   s(s),
   averageTickInterval(50000),
   lastTickOn(std::chrono::steady_clock::now()) {
@@ -61,7 +66,7 @@ World& WorldManager::getOrLoadWorld(std::string name) {
 		sr = worlds.emplace(
 			std::piecewise_construct,
 			std::forward_as_tuple(name),
-			std::forward_as_tuple(s.getWorldStorageArgsFor(name), tb)
+			std::forward_as_tuple(s.getWorldStorageArgsFor(name), tb, chunkResponses)
 		).first;
 
 		sr->second.setUnloadFunc([this, sr] {
@@ -93,6 +98,15 @@ bool WorldManager::saveAll() {
 	return didStuff;
 }
 
+bool WorldManager::saveAllNow() {
+	bool didStuff = false;
+	for (auto& w : worlds) {
+		didStuff |= w.second.saveNow();
+	}
+
+	return didStuff;
+}
+
 sz_t WorldManager::unloadOldChunks(bool all) {
 	sz_t totalUnloaded = 0;
 	for (auto& w : worlds) {
@@ -102,6 +116,55 @@ sz_t WorldManager::unloadOldChunks(bool all) {
 	return totalUnloaded;
 }
 
+sz_t WorldManager::unloadColdestChunks(sz_t count) {
+	sz_t totalUnloaded = 0;
+	// worlds with nothing to unload right now, all their chunks are in use or saving
+	std::unordered_set<World *> exhausted;
+	// one at a time, from the world with the least recently used chunk
+	while (totalUnloaded < count) {
+		World * coldest = nullptr;
+		std::chrono::steady_clock::time_point coldestTime;
+		for (auto& w : worlds) {
+			auto t = w.second.getColdestChunkTime();
+			if (t && (!coldest || *t < coldestTime) && !exhausted.count(&w.second)) {
+				coldest = &w.second;
+				coldestTime = *t;
+			}
+		}
+
+		if (!coldest) {
+			break;
+		}
+
+		if (coldest->unloadColdestChunks(1) == 0) {
+			exhausted.emplace(coldest);
+			continue;
+		}
+
+		++totalUnloaded;
+	}
+
+	return totalUnloaded;
+}
+
+nlohmann::json WorldManager::getClusterConversionInfo() const {
+	sz_t remaining = 0;
+	sz_t converting = 0;
+	sz_t converted = 0;
+	for (const auto& w : worlds) {
+		remaining += w.second.getRemainingClusterCount();
+		converting += w.second.getClusterConversionsInFlight();
+		converted += w.second.getConvertedClusterCount();
+	}
+
+	// only counts the loaded worlds
+	return {
+		{ "remaining", remaining },
+		{ "converting", converting },
+		{ "converted", converted }
+	};
+}
+
 float WorldManager::getTps() const {
 	return (std::chrono::seconds(1) / averageTickInterval);
 }
@@ -109,8 +172,15 @@ float WorldManager::getTps() const {
 void WorldManager::tickWorlds() {
 	auto now(std::chrono::steady_clock::now());
 
+	sz_t loadedChunks = 0;
 	for (auto& w : worlds) {
 		w.second.sendUpdates();
+		w.second.convertOldClusters();
+		loadedChunks += w.second.getLoadedChunkCount();
+	}
+
+	if (loadedChunks > WORLD_MAX_CHUNKS_LOADED_TOTAL) {
+		unloadColdestChunks(loadedChunks - WORLD_MAX_CHUNKS_LOADED_TOTAL);
 	}
 
 	averageTickInterval = (now - lastTickOn + averageTickInterval) / 2.f;
@@ -6,6 +6,7 @@
 #include <chrono>
 
 #include <World.hpp>
+#include <ChunkResponseCache.hpp>
 
 #include <explints.hpp>
 
@@ -16,6 +17,7 @@ class TimedCallbacks;
 class WorldManager {
 	using FloatMicros = std::chrono::duration<float, std::chrono::microseconds::period>;
 
+	ChunkResponseCache chunkResponses; // must outlive the worlds
 	std::map<std::string, World> worlds;
 	TaskBuffer& tb;
 	Storage& s;
@@ -42,9 +44,12 @@ public:
 
 	sz_t loadedWorlds() const;
 	bool saveAll();
+	bool saveAllNow(); // only once the task buffer is stopped
 
 	sz_t unloadOldChunks(bool all = false);
+	sz_t unloadColdestChunks(sz_t count);
 
+	nlohmann::json getClusterConversionInfo() const;
 	float getTps() const;
 
 private:
@@ -5,11 +5,37 @@
 
 /* Will close old file handles */
 #define WORLD_MAX_FILE_HANDLES 16
+
+/* Default per world chunk limit, can be changed with the 'maxchunks' world property.
+ * The least recently used chunks are unloaded first */
 #define WORLD_MAX_CHUNKS_LOADED 2048
+/* Limit for the chunks loaded in all worlds */
+#define WORLD_MAX_CHUNKS_LOADED_TOTAL 8192
+
+/* Chunks of a world being encoded and written by worker threads at the same time */
+#define WORLD_MAX_CHUNK_SAVES_IN_FLIGHT 4
+
+/* Default for the 'convertjobs' world property, old .pxr clusters being converted
+ * by worker threads at the same time. 0 only converts them when they're needed */
+#define WORLD_MAX_CLUSTER_CONVERSIONS 2
+
+/* Memory for the PNGs of recently requested chunks, shared by all worlds */
+#define WORLD_CHUNK_RESPONSE_CACHE_BYTES (64 * 1024 * 1024)
 
 /* Negative and positive X and Y range of chunks allowed to be created */
 #define WORLD_MAX_CHUNK_XY 0xFFFFF
 
+/* Chunks one area protection can span */
+#define WORLD_MAX_PROTECTION_AREA_CHUNKS 256
+
+/* Size of the squares players subscribe to for cursor and pixel updates,
+ * in chunks. Must be a power of two */
+#define WORLD_INTEREST_CELL_CHUNKS 4
+/* Viewport width and height limit, and the size of the viewport players
+ * have until the client sends one, in chunks */
+#define WORLD_MAX_VIEWPORT_CHUNKS 32
+#define WORLD_DEFAULT_VIEWPORT_CHUNKS 4
+
 /* Rate of world updates sent to the client */
 #define WORLD_UPDATE_RATE_MSEC 60
 
@@ -21,12 +47,25 @@
 /* Maximum value is 65535, max pixel updates every WORLD_UPDATE_RATE_MSEC */
 #define WORLD_MAX_PIXEL_UPDATES 4096
 
+/* Pixels one line, rectangle or blit packet can paint, they still
+ * have to fit in the player's paint bucket */
+#define WORLD_MAX_BULK_PAINT_PIXELS 4096
+
 /***
  * Client config
  ***/
 
 #define CLIENT_MAX_WARN_LEVEL 128
 
+/* Bytes waiting to be sent to a client after which it stops getting cursor
+ * updates, and after which pixel updates are dropped too. It's told to fetch
+ * the chunks again once it catches up */
+#define CLIENT_CURSOR_DROP_BUFFERED_BYTES (256 * 1024)
+#define CLIENT_STALE_BUFFERED_BYTES (1024 * 1024)
+
+/* In bytes */
+#define CLIENT_MAX_CHAT_LENGTH 256
+
 /* (rate, per n seconds) */
 #define CLIENT_PIXEL_UPD_RATELIMIT 32, 4
 #define CLIENT_CHAT_RATELIMIT 4, 6